@@ -7,9 +7,20 @@ ext_modules = [
         [
             "src/bindings.cpp",
             "src/bvh.cpp",
+            "src/lbvh.cpp",
+            "src/refit.cpp",
+            "src/scene.cpp",
+            "src/closest_point.cpp",
+            "src/tree_stats.cpp",
+            "src/sbvh.cpp",
+            "src/optimize.cpp",
+            "src/range_query.cpp",
+            "src/render.cpp",
+            "src/packet.cpp",
         ],
         include_dirs=["include"],
         libraries=["assimp"],
+        extra_compile_args=["-O3", "-march=native"],
     ),
 ]
 
@@ -0,0 +1,319 @@
+// Build and traversal benchmark on procedural meshes, prints one JSON document to stdout.
+// Usage: bench [scale], scale multiplies the number of faces of every mesh (default 1).
+
+#include <glm/glm.hpp>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int RAY_GRID = 512;    // coherent rays are a RAY_GRID x RAY_GRID camera
+const int N_RANDOM_RAYS = 1 << 18;
+const int RAYS_PER_TASK = 1024;
+
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Linux only: writing 5 to clear_refs resets the peak resident set size to the current one,
+// so that every build gets a peak of its own. False where that isn't possible.
+static bool reset_peak_rss() {
+#ifdef __GLIBC__
+    // hand freed heap of earlier builds back first, else this build reuses it without growing
+    malloc_trim(0);
+#endif
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (!file) {
+        return false;
+    }
+    bool written = fputs("5", file) >= 0;
+    return fclose(file) == 0 && written;
+}
+
+
+// VmRSS (current) or VmHWM (peak since the last reset) of /proc/self/status in MB, -1 if missing
+static double status_mb(const char *field) {
+    FILE *file = fopen("/proc/self/status", "r");
+    if (!file) {
+        return -1;
+    }
+    double mb = -1;
+    char line[256];
+    size_t length = strlen(field);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, length) == 0 && line[length] == ':') {
+            mb = atol(line + length + 1) / 1024.0;
+            break;
+        }
+    }
+    fclose(file);
+    return mb;
+}
+
+
+// JSON number with one decimal, or null for a negative (unknown) value
+static std::string json_mb(double mb) {
+    if (mb < 0) {
+        return "null";
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.1f", mb);
+    return buffer;
+}
+
+
+// grid x grid UV spheres with 2 * res * res faces each
+static void make_spheres(Mesh& mesh, int grid, int res) {
+    for (int gx = 0; gx < grid; gx++) {
+        for (int gy = 0; gy < grid; gy++) {
+            glm::vec3 center(gx * 3.0f, gy * 3.0f, 0);
+            unsigned base = mesh.vertices.size();
+            for (int i = 0; i <= res; i++) {
+                for (int j = 0; j <= res; j++) {
+                    float theta = M_PI * i / res, phi = 2 * M_PI * j / res;
+                    mesh.vertices.push_back(center + glm::vec3(std::sin(theta) * std::cos(phi), std::sin(theta) * std::sin(phi), std::cos(theta)));
+                }
+            }
+            for (int i = 0; i < res; i++) {
+                for (int j = 0; j < res; j++) {
+                    unsigned a = base + i * (res + 1) + j, b = a + 1, c = a + res + 1, d = c + 1;
+                    mesh.faces.push_back(Face(a, b, d));
+                    mesh.faces.push_back(Face(a, d, c));
+                }
+            }
+        }
+    }
+}
+
+
+// small triangles scattered uniformly in the unit cube
+static void make_soup(Mesh& mesh, int n_faces, std::mt19937& rng) {
+    std::uniform_real_distribution<float> pos(0, 1), offset(-0.01f, 0.01f);
+    for (int i = 0; i < n_faces; i++) {
+        glm::vec3 p(pos(rng), pos(rng), pos(rng));
+        unsigned base = mesh.vertices.size();
+        mesh.vertices.push_back(p);
+        mesh.vertices.push_back(p + glm::vec3(offset(rng), offset(rng), offset(rng)));
+        mesh.vertices.push_back(p + glm::vec3(offset(rng), offset(rng), offset(rng)));
+        mesh.faces.push_back(Face(base, base + 1, base + 2));
+    }
+}
+
+
+// triangles 0.2 long and 0.001 wide in the unit cube in random directions, their boxes overlap heavily
+static void make_slivers(Mesh& mesh, int n_faces, std::mt19937& rng) {
+    std::uniform_real_distribution<float> pos(0, 1), offset(-0.001f, 0.001f);
+    std::normal_distribution<float> normal;
+    for (int i = 0; i < n_faces; i++) {
+        glm::vec3 a(pos(rng), pos(rng), pos(rng));
+        glm::vec3 b = a + 0.2f * glm::normalize(glm::vec3(normal(rng), normal(rng), normal(rng)));
+        unsigned base = mesh.vertices.size();
+        mesh.vertices.push_back(a);
+        mesh.vertices.push_back(b);
+        mesh.vertices.push_back(a + glm::vec3(offset(rng), offset(rng), offset(rng)));
+        mesh.faces.push_back(Face(base, base + 1, base + 2));
+    }
+}
+
+
+struct Ray {
+    glm::vec3 o, d;
+};
+
+
+// pinhole camera in front of the box looking at its center
+static std::vector<Ray> coherent_rays(const glm::vec3& min, const glm::vec3& max) {
+    glm::vec3 center = (min + max) * 0.5f, extent = max - min;
+    glm::vec3 eye = center + glm::vec3(0.3f, -0.5f, 1.0f) * glm::length(extent);
+    glm::vec3 forward = glm::normalize(center - eye);
+    glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0, 1, 0)));
+    glm::vec3 up = glm::cross(right, forward);
+
+    std::vector<Ray> rays(RAY_GRID * RAY_GRID);
+    for (int y = 0; y < RAY_GRID; y++) {
+        for (int x = 0; x < RAY_GRID; x++) {
+            float u = (x + 0.5f) / RAY_GRID - 0.5f, v = (y + 0.5f) / RAY_GRID - 0.5f;
+            rays[y * RAY_GRID + x] = {eye, forward + 0.8f * (u * right + v * up)};
+        }
+    }
+    return rays;
+}
+
+
+// origins inside the box, uniformly random directions
+static std::vector<Ray> incoherent_rays(const glm::vec3& min, const glm::vec3& max, std::mt19937& rng) {
+    std::uniform_real_distribution<float> unit(0, 1);
+    std::normal_distribution<float> normal;
+    std::vector<Ray> rays(N_RANDOM_RAYS);
+    for (Ray& ray : rays) {
+        ray.o = min + glm::vec3(unit(rng), unit(rng), unit(rng)) * (max - min);
+        ray.d = glm::vec3(normal(rng), normal(rng), normal(rng));
+    }
+    return rays;
+}
+
+
+// closest hit of every ray, one at a time or in SIMD packets of consecutive rays; returns seconds and the number of hits
+static std::tuple<double, long> trace(BVH& bvh, const std::vector<Ray>& rays, int n_threads, bool packets) {
+    ThreadPool& pool = shared_thread_pool(n_threads);
+    std::vector<long> hits((rays.size() + RAYS_PER_TASK - 1) / RAYS_PER_TASK);
+
+    std::vector<glm::vec3> origins(rays.size()), directions(rays.size());
+    for (int i = 0; i < rays.size(); i++) {
+        origins[i] = rays[i].o;
+        directions[i] = rays[i].d;
+    }
+
+    double start = now();
+    pool.parallel_for(0, rays.size(), RAYS_PER_TASK, [&](int begin, int end) {
+        long n = 0;
+        if (packets) {
+            std::unique_ptr<bool[]> mask(new bool[end - begin]);
+            std::vector<int> face(end - begin);
+            std::vector<float> t(end - begin);
+            bvh.closest_hit_packets(end - begin, origins.data() + begin, directions.data() + begin, 0, FLT_MAX, {mask.get(), face.data(), t.data()});
+            n = std::count(mask.get(), mask.get() + end - begin, true);
+        } else {
+            for (int i = begin; i < end; i++) {
+                n += std::get<0>(bvh.closest_hit(origins[i], directions[i]));
+            }
+        }
+        hits[begin / RAYS_PER_TASK] = n;
+    });
+    double seconds = now() - start;
+
+    long total = 0;
+    for (long n : hits) {
+        total += n;
+    }
+    return {seconds, total};
+}
+
+
+struct Method {
+    const char *name;
+    BuildMethod method;
+    bool refine;
+    bool leaf_triangles = false;
+};
+
+
+int main(int argc, char **argv) {
+    double scale = argc > 1 ? std::atof(argv[1]) : 1.0;
+    if (!(scale > 0)) {
+        fprintf(stderr, "usage: %s [scale]\n", argv[0]);
+        return 1;
+    }
+
+    int hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> thread_counts;
+    for (int n = 1; n < hardware_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(hardware_threads);
+
+    const Method methods[] = {
+        {"sweep", BuildMethod::Sweep, false},
+        {"binned_sah", BuildMethod::BinnedSAH, false},
+        {"binned_sah_leaf_triangles", BuildMethod::BinnedSAH, false, true},
+        {"lbvh", BuildMethod::LBVH, false},
+        {"lbvh_refine", BuildMethod::LBVH, true},
+        {"sbvh", BuildMethod::SBVH, false},
+    };
+    const char *meshes[] = {"spheres", "soup", "slivers"};
+
+    printf("{\n  \"scale\": %g,\n  \"hardware_threads\": %d,\n  \"results\": [", scale, hardware_threads);
+    bool first_result = true;
+
+    for (const char *mesh_name : meshes) {
+        std::mt19937 rng(1);
+        Mesh mesh;
+        std::string name = mesh_name;
+        if (name == "spheres") {
+            make_spheres(mesh, std::max(1, (int) std::lround(16 * std::sqrt(scale))), 32);
+        } else if (name == "soup") {
+            make_soup(mesh, 500000 * scale, rng);
+        } else {
+            make_slivers(mesh, 250000 * scale, rng);
+        }
+
+        // every method traces the same rays
+        glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+        for (const glm::vec3& v : mesh.vertices) {
+            min = glm::min(min, v);
+            max = glm::max(max, v);
+        }
+        std::vector<Ray> ray_sets[] = {coherent_rays(min, max), incoherent_rays(min, max, rng)};
+        const char *ray_names[] = {"coherent", "incoherent"};
+
+        for (const Method& method : methods) {
+            BVH bvh;
+            bvh.mesh = mesh;
+
+            BuildParams params;
+            params.method = method.method;
+            params.refine = method.refine;
+            params.leaf_triangles = method.leaf_triangles;
+            params.depth = 64;
+
+            // the peak of this build alone, not of the meshes and rays of earlier rows
+            bool peak_reset = reset_peak_rss();
+            double rss_before = status_mb("VmRSS");
+            double start = now();
+            bvh.build_bvh(params);
+            double build_time = now() - start;
+            double peak_rss = peak_reset ? status_mb("VmHWM") : -1;
+            double build_rss = peak_rss >= 0 && rss_before >= 0 ? peak_rss - rss_before : -1;
+
+            int max_leaf_size = 0;
+            for (const FlatNode& node : bvh.flat_nodes) {
+                if (node.is_leaf()) {
+                    max_leaf_size = std::max(max_leaf_size, (int) node.count);
+                }
+            }
+            int n_leaves = bvh.n_leaves();
+
+            printf("%s\n    {\"mesh\": \"%s\", \"faces\": %zu, \"method\": \"%s\", \"build_seconds\": %.4f, \"peak_rss_mb\": %s, \"build_rss_mb\": %s, "
+                   "\"sah_cost\": %.3f, \"depth\": %d, \"nodes\": %d, \"leaves\": %d, \"avg_leaf_size\": %.2f, \"max_leaf_size\": %d, \"traversal\": [",
+                   first_result ? "" : ",", mesh_name, mesh.faces.size(), method.name, build_time, json_mb(peak_rss).c_str(), json_mb(build_rss).c_str(),
+                   bvh.sah_cost(), bvh.depth(), bvh.n_nodes(), n_leaves, (double) mesh.faces.size() / n_leaves, max_leaf_size);
+            first_result = false;
+
+            bool first_run = true;
+            for (int k = 0; k < 2; k++) {
+                for (bool packets : {false, true}) {
+                    for (int n_threads : thread_counts) {
+                        auto [seconds, hits] = trace(bvh, ray_sets[k], n_threads, packets);
+                        printf("%s\n      {\"rays\": \"%s\", \"packets\": %s, \"threads\": %d, \"mrays_per_second\": %.2f, \"hit_rate\": %.4f}",
+                               first_run ? "" : ",", ray_names[k], packets ? "true" : "false", n_threads, ray_sets[k].size() / seconds * 1e-6,
+                               (double) hits / ray_sets[k].size());
+                        first_run = false;
+                    }
+                }
+            }
+            printf("\n    ]}");
+            fflush(stdout);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -2,103 +2,829 @@
 #include <pybind11/numpy.h>
 
 #include <tuple>
+#include <cmath>
+#include <stdexcept>
+#include <type_traits>
 
 #include "bvh.h"
+#include "scene.h"
+#include "thread_pool.h"
 
 namespace py = pybind11;
 
+
+const int RAYS_PER_TASK = 1024;
+
+
+// calls f(begin, end) on chunks of [0, n) from n_threads threads (0 means all cores) with the GIL released
+template <typename F>
+void parallel_for_rays(int n, int n_threads, const F& f) {
+    py::gil_scoped_release release;
+    shared_thread_pool(n > RAYS_PER_TASK ? n_threads : 1).parallel_for(0, n, RAYS_PER_TASK, f);
+}
+
+
+using Vec3Array = py::array_t<float, py::array::c_style | py::array::forcecast>;
+
+
+// checks that origins and directions are matching (N,3) arrays and returns N
+int check_rays(const Vec3Array& ray_origins, const Vec3Array& ray_directions) {
+    if (ray_origins.ndim() != 2 || ray_origins.shape(1) != 3) {
+        throw std::runtime_error("ray_origins must have shape (N,3)");
+    }
+    if (ray_directions.ndim() != 2 || ray_directions.shape(1) != 3) {
+        throw std::runtime_error("ray_directions must have shape (N,3)");
+    }
+    if (ray_directions.shape(0) != ray_origins.shape(0)) {
+        throw std::runtime_error("Mismatched shapes!");
+    }
+    return ray_origins.shape(0);
+}
+
+
+// everything that reads flat_nodes[0] needs build_bvh or load first
+void check_built(const BVH& self) {
+    if (self.flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+}
+
+
+// per-query TraversalStats of a batch, queries called with return_stats=True append to_dict() to their results
+struct StatsArrays {
+    py::array_t<int> nodes_visited, box_tests, leaves_tested, triangle_tests, max_stack;
+    int *nodes_visited_ptr, *box_tests_ptr, *leaves_tested_ptr, *triangle_tests_ptr, *max_stack_ptr;
+
+    StatsArrays(int n) : nodes_visited({n}), box_tests({n}), leaves_tested({n}), triangle_tests({n}), max_stack({n}) {
+        nodes_visited_ptr = nodes_visited.mutable_data();
+        box_tests_ptr = box_tests.mutable_data();
+        leaves_tested_ptr = leaves_tested.mutable_data();
+        triangle_tests_ptr = triangle_tests.mutable_data();
+        max_stack_ptr = max_stack.mutable_data();
+    }
+
+    void set(int i, const TraversalStats& stats) {
+        nodes_visited_ptr[i] = stats.nodes_visited;
+        box_tests_ptr[i] = stats.box_tests;
+        leaves_tested_ptr[i] = stats.leaves_tested;
+        triangle_tests_ptr[i] = stats.triangle_tests;
+        max_stack_ptr[i] = stats.max_stack;
+    }
+
+    py::dict to_dict() const {
+        py::dict result;
+        result["nodes_visited"] = nodes_visited;
+        result["box_tests"] = box_tests;
+        result["leaves_tested"] = leaves_tested;
+        result["triangle_tests"] = triangle_tests;
+        result["max_stack"] = max_stack;
+        return result;
+    }
+};
+
+
+// batched closest_hit / any_hit, returns mask, t, face index and barycentrics (u, v) per ray,
+// for a Scene also the instance id after t
+template <bool AnyHit, typename Accel>
+py::tuple intersect_triangles(Accel& self, Vec3Array ray_origins, Vec3Array ray_directions, float t_min, float t_max, int n_threads, bool return_stats,
+                              bool packets) {
+    constexpr bool instanced = std::is_same_v<Accel, Scene>;
+    if (packets && return_stats) {
+        throw std::runtime_error("return_stats counts single rays, it can't be combined with packets");
+    }
+    if constexpr (instanced) {
+        if (self.dirty) {
+            self.build();
+        }
+    } else if (self.flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+
+    int n_rays = check_rays(ray_origins, ray_directions);
+    const glm::vec3 *ray_origins_ptr = (const glm::vec3 *) ray_origins.data();
+    const glm::vec3 *ray_directions_ptr = (const glm::vec3 *) ray_directions.data();
+
+    py::array_t<bool> mask({n_rays});
+    py::array_t<float> t({n_rays});
+    py::array_t<int> instance_ids({instanced ? n_rays : 0});
+    py::array_t<int> face_indices({n_rays});
+    py::array_t<float> barycentrics({n_rays, 2});
+
+    bool *mask_ptr = mask.mutable_data();
+    float *t_ptr = t.mutable_data();
+    int *instance_ids_ptr = instance_ids.mutable_data();
+    int *face_indices_ptr = face_indices.mutable_data();
+    float *barycentrics_ptr = barycentrics.mutable_data();
+    StatsArrays stats(return_stats ? n_rays : 0);
+
+    parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+        if constexpr (!instanced) {
+            if (packets) {
+                HitTarget out = {mask_ptr + begin, face_indices_ptr + begin, t_ptr + begin, barycentrics_ptr + 2 * begin};
+                if (AnyHit) {
+                    self.any_hit_packets(end - begin, ray_origins_ptr + begin, ray_directions_ptr + begin, t_min, t_max, out);
+                } else {
+                    self.closest_hit_packets(end - begin, ray_origins_ptr + begin, ray_directions_ptr + begin, t_min, t_max, out);
+                }
+                return;
+            }
+        }
+
+        for (int i = begin; i < end; ++i) {
+            auto query = [&](auto&... ray_stats) {
+                return AnyHit
+                    ? self.any_hit(ray_origins_ptr[i], ray_directions_ptr[i], t_min, t_max, ray_stats...)
+                    : self.closest_hit(ray_origins_ptr[i], ray_directions_ptr[i], t_min, t_max, ray_stats...);
+            };
+
+            decltype(query()) result;
+            if constexpr (instanced) {
+                result = query();
+            } else if (return_stats) {
+                TraversalStats ray_stats;
+                result = query(ray_stats);
+                stats.set(i, ray_stats);
+            } else {
+                result = query();
+            }
+
+            // Scene results carry the instance id in front of the face index
+            constexpr int k = instanced;
+            if constexpr (instanced) {
+                instance_ids_ptr[i] = std::get<1>(result);
+            }
+            mask_ptr[i] = std::get<0>(result);
+            face_indices_ptr[i] = std::get<1 + k>(result);
+            t_ptr[i] = std::get<2 + k>(result);
+            barycentrics_ptr[2 * i] = std::get<3 + k>(result);
+            barycentrics_ptr[2 * i + 1] = std::get<4 + k>(result);
+        }
+    });
+
+    if constexpr (instanced) {
+        return py::make_tuple(mask, t, instance_ids, face_indices, barycentrics);
+    } else if (return_stats) {
+        return py::make_tuple(mask, t, face_indices, barycentrics, stats.to_dict());
+    } else {
+        return py::make_tuple(mask, t, face_indices, barycentrics);
+    }
+}
+
+
+// batched closest_point, returns distance, closest point, face index and barycentrics (u, v) per point;
+// points with no face within max_distance get face index -1 and distance max_distance
+py::tuple closest_point(BVH& self, Vec3Array points, float max_distance, int n_threads, bool return_stats) {
+    if (points.ndim() != 2 || points.shape(1) != 3) {
+        throw std::runtime_error("points must have shape (N,3)");
+    }
+    if (self.flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+    if (!(max_distance >= 0)) {
+        throw std::runtime_error("max_distance must not be negative");
+    }
+    int n_points = points.shape(0);
+    const glm::vec3 *points_ptr = (const glm::vec3 *) points.data();
+
+    py::array_t<float> distance({n_points});
+    py::array_t<float> closest_points({n_points, 3});
+    py::array_t<int> face_indices({n_points});
+    py::array_t<float> barycentrics({n_points, 2});
+
+    float *distance_ptr = distance.mutable_data();
+    glm::vec3 *closest_points_ptr = (glm::vec3 *) closest_points.mutable_data();
+    int *face_indices_ptr = face_indices.mutable_data();
+    float *barycentrics_ptr = barycentrics.mutable_data();
+    StatsArrays stats(return_stats ? n_points : 0);
+
+    parallel_for_rays(n_points, n_threads, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            TraversalStats point_stats;
+            auto [found, face, dist, point, u, v] = return_stats
+                ? self.closest_point(points_ptr[i], max_distance, point_stats)
+                : self.closest_point(points_ptr[i], max_distance);
+            if (return_stats) {
+                stats.set(i, point_stats);
+            }
+
+            distance_ptr[i] = dist;
+            closest_points_ptr[i] = point;
+            face_indices_ptr[i] = face;
+            barycentrics_ptr[2 * i] = u;
+            barycentrics_ptr[2 * i + 1] = v;
+        }
+    });
+
+    if (return_stats) {
+        return py::make_tuple(distance, closest_points, face_indices, barycentrics, stats.to_dict());
+    }
+    return py::make_tuple(distance, closest_points, face_indices, barycentrics);
+}
+
+
+// view of an array's data that keeps the array alive
+template <typename T, typename Array>
+Buffer<T> view_array(const Array& array) {
+    std::shared_ptr<const void> owner(new Array(array), [](const Array *p) {
+        py::gil_scoped_acquire acquire;
+        delete p;
+    });
+    return Buffer<T>::view((const T *) array.data(), array.shape(0), owner);
+}
+
+
+// mesh viewing the given arrays, they are only copied if they are not contiguous float32 / uint32
+BVH from_arrays(Vec3Array vertices, py::array_t<uint32_t, py::array::c_style | py::array::forcecast> faces) {
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float) && sizeof(Face) == 3 * sizeof(uint32_t));
+
+    if (vertices.ndim() != 2 || vertices.shape(1) != 3) {
+        throw std::runtime_error("vertices must have shape (V,3)");
+    }
+    if (faces.ndim() != 2 || faces.shape(1) != 3) {
+        throw std::runtime_error("faces must have shape (F,3)");
+    }
+
+    const uint32_t *faces_ptr = faces.data();
+    uint32_t n_vertices = vertices.shape(0);
+    for (ssize_t i = 0; i < 3 * faces.shape(0); ++i) {
+        if (faces_ptr[i] >= n_vertices) {
+            throw std::runtime_error("face indices must be smaller than the number of vertices");
+        }
+    }
+
+    BVH bvh;
+    bvh.mesh.vertices = view_array<glm::vec3>(vertices);
+    bvh.mesh.faces = view_array<Face>(faces);
+    return bvh;
+}
+
+
+// all leaves along every ray in CSR form: leaves of ray i are [offsets[i], offsets[i + 1]),
+// for a Scene every leaf also gets its instance id, returned before the leaf indices
+template <typename Accel>
+py::tuple intersect_all_leaves(Accel& self, Vec3Array ray_origins, Vec3Array ray_directions, int max_hits, int n_threads, bool return_stats) {
+    constexpr bool instanced = std::is_same_v<Accel, Scene>;
+    if constexpr (instanced) {
+        if (self.dirty) {
+            self.build();
+        }
+    } else if (self.flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+
+    int n_rays = check_rays(ray_origins, ray_directions);
+    const glm::vec3 *ray_origins_ptr = (const glm::vec3 *) ray_origins.data();
+    const glm::vec3 *ray_directions_ptr = (const glm::vec3 *) ray_directions.data();
+
+    py::array_t<int64_t> offsets({n_rays + 1});
+    int64_t *offsets_ptr = offsets.mutable_data();
+
+    // every chunk of rays collects its hits separately, then they are copied into place
+    std::vector<std::vector<LeafHit>> chunk_hits((n_rays + RAYS_PER_TASK - 1) / RAYS_PER_TASK);
+    StatsArrays stats(return_stats ? n_rays : 0);
+    parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+        std::vector<LeafHit>& hits = chunk_hits[begin / RAYS_PER_TASK];
+        for (int i = begin; i < end; ++i) {
+            int before = hits.size();
+            if constexpr (instanced) {
+                self.intersect_all_leaves(ray_origins_ptr[i], ray_directions_ptr[i], max_hits, hits);
+            } else if (return_stats) {
+                TraversalStats ray_stats;
+                self.intersect_all_leaves(ray_origins_ptr[i], ray_directions_ptr[i], max_hits, hits, ray_stats);
+                stats.set(i, ray_stats);
+            } else {
+                self.intersect_all_leaves(ray_origins_ptr[i], ray_directions_ptr[i], max_hits, hits);
+            }
+            offsets_ptr[i + 1] = hits.size() - before;
+        }
+    });
+
+    offsets_ptr[0] = 0;
+    for (int i = 0; i < n_rays; ++i) {
+        offsets_ptr[i + 1] += offsets_ptr[i];
+    }
+    int64_t n_hits = offsets_ptr[n_rays];
+
+    py::array_t<int> instance_ids({instanced ? n_hits : 0});
+    py::array_t<int> leaf_indices({n_hits});
+    py::array_t<float> t_enters({n_hits});
+    py::array_t<float> t_exits({n_hits});
+    int *instance_ids_ptr = instance_ids.mutable_data();
+    int *leaf_indices_ptr = leaf_indices.mutable_data();
+    float *t_enters_ptr = t_enters.mutable_data();
+    float *t_exits_ptr = t_exits.mutable_data();
+
+    parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+        const std::vector<LeafHit>& hits = chunk_hits[begin / RAYS_PER_TASK];
+        int64_t offset = offsets_ptr[begin];
+        for (size_t j = 0; j < hits.size(); ++j) {
+            if (instanced) {
+                instance_ids_ptr[offset + j] = hits[j].instance;
+            }
+            leaf_indices_ptr[offset + j] = hits[j].leaf;
+            t_enters_ptr[offset + j] = hits[j].t_enter;
+            t_exits_ptr[offset + j] = hits[j].t_exit;
+        }
+    });
+
+    if constexpr (instanced) {
+        return py::make_tuple(offsets, instance_ids, leaf_indices, t_enters, t_exits);
+    } else if (return_stats) {
+        return py::make_tuple(offsets, leaf_indices, t_enters, t_exits, stats.to_dict());
+    } else {
+        return py::make_tuple(offsets, leaf_indices, t_enters, t_exits);
+    }
+}
+
+
+// reads a (3,4) object to world matrix
+void read_transform(const py::array_t<float, py::array::c_style | py::array::forcecast>& array, float transform[3][4]) {
+    if (array.ndim() != 2 || array.shape(0) != 3 || array.shape(1) != 4) {
+        throw std::runtime_error("transform must have shape (3,4)");
+    }
+    std::copy(array.data(), array.data() + 12, &transform[0][0]);
+}
+
+
+// reads a (3,) array
+glm::vec3 read_vec3(const Vec3Array& array, const char *name) {
+    if (array.ndim() != 1 || array.shape(0) != 3) {
+        throw std::runtime_error(std::string(name) + " must have shape (3,)");
+    }
+    return glm::vec3(array.data()[0], array.data()[1], array.data()[2]);
+}
+
+
+// pixels of an output image the caller allocated, null for None; written in place, so it is never converted
+template <typename T>
+T *image_pixels(const py::object& image, int width, int height, const char *name, const char *dtype) {
+    if (image.is_none()) {
+        return nullptr;
+    }
+    if (!py::isinstance<py::array_t<T, py::array::c_style>>(image)) {
+        throw std::runtime_error(std::string(name) + " must be a C-contiguous " + dtype + " array");
+    }
+    auto array = py::reinterpret_borrow<py::array_t<T, py::array::c_style>>(image);
+    if (array.ndim() != 2 || array.shape(0) != height || array.shape(1) != width) {
+        throw std::runtime_error(std::string(name) + " must have shape (height,width)");
+    }
+    if (!array.writeable()) {
+        throw std::runtime_error(std::string(name) + " must be writeable");
+    }
+    return array.mutable_data();
+}
+
+
+// traversal state the next call resumes from, updated in place, so it is never converted: a converted
+// copy would lose the updates
+template <typename T>
+py::array_t<T, py::array::c_style> state_array(const py::object& object, const char *name, const char *dtype) {
+    if (!py::isinstance<py::array_t<T, py::array::c_style>>(object)) {
+        throw std::runtime_error(std::string(name) + " must be a C-contiguous " + dtype + " array");
+    }
+    auto array = py::reinterpret_borrow<py::array_t<T, py::array::c_style>>(object);
+    if (!array.writeable()) {
+        throw std::runtime_error(std::string(name) + " must be writeable");
+    }
+    return array;
+}
+
+
 PYBIND11_MODULE(bvh, m) {
-    py::class_<BVH>(m, "BVH")
+    py::enum_<BuildMethod>(m, "BuildMethod")
+        .value("Sweep", BuildMethod::Sweep)
+        .value("BinnedSAH", BuildMethod::BinnedSAH)
+        .value("LBVH", BuildMethod::LBVH)
+        .value("SBVH", BuildMethod::SBVH);
+
+    py::enum_<NodeLayout>(m, "NodeLayout")
+        .value("Flat", NodeLayout::Flat)
+        .value("Quantized8", NodeLayout::Quantized8)
+        .value("Quantized16", NodeLayout::Quantized16)
+        .value("Wide4", NodeLayout::Wide4)
+        .value("Wide8", NodeLayout::Wide8);
+
+    py::enum_<Projection>(m, "Projection")
+        .value("Pinhole", Projection::Pinhole)
+        .value("Orthographic", Projection::Orthographic);
+
+    py::enum_<RenderMode>(m, "RenderMode")
+        .value("FirstLeaf", RenderMode::FirstLeaf)
+        .value("ClosestHit", RenderMode::ClosestHit);
+
+    // right and up span the image plane, their lengths set the field of view (pinhole) or the extent (orthographic)
+    py::class_<Camera>(m, "Camera")
+        .def(py::init([](Vec3Array origin, Vec3Array forward, Vec3Array right, Vec3Array up, Projection projection) {
+            return Camera{read_vec3(origin, "origin"), read_vec3(forward, "forward"), read_vec3(right, "right"), read_vec3(up, "up"), projection};
+        }), py::arg("origin"), py::arg("forward"), py::arg("right"), py::arg("up"), py::arg("projection") = Projection::Pinhole)
+        .def_readwrite("projection", &Camera::projection);
+
+    py::class_<BVH, std::shared_ptr<BVH>>(m, "BVH")
         .def(py::init<>())
         .def("load_scene", &BVH::load_scene)
-        .def("build_bvh", &BVH::build_bvh)
-        .def("save_as_obj", &BVH::save_as_obj)
-        .def("intersect_leaves", [](
-            BVH& self,
-            py::array_t<float> ray_origins,
-            py::array_t<float> ray_directions,
-            py::array_t<int> stack_size,
-            py::array_t<uint32_t> stack
-        ) {
-            auto ray_origins_buf = ray_origins.request();
-            auto ray_directions_buf = ray_directions.request();
-            auto stack_size_buf = stack_size.request();
-            auto stack_buf = stack.request();
-
-            int n_rays = ray_origins_buf.shape[0];
-    
-            if (ray_directions_buf.shape[0] != n_rays || stack_size_buf.shape[0] != n_rays) {
-                throw std::runtime_error("Mismatched shapes!");
-            }
-
-            if (ray_directions_buf.ndim != 2 || ray_directions_buf.shape[1] != 3) {
-                throw std::runtime_error("ray_directions must have shape (N,3)");
-            }
-            if (ray_directions_buf.itemsize != sizeof(float)) {
-                throw std::runtime_error("ray_directions must have dtype float32");
-            }
-
-            if (stack_size_buf.ndim != 1) {
-                throw std::runtime_error("stack_size must have shape (N,)");
+        .def_static("from_arrays", &from_arrays,
+            "BVH over a mesh given as (V,3) vertices and (F,3) faces. Contiguous float32 vertices and uint32 faces are\n"
+            "not copied: the BVH keeps using the caller's arrays, so they must not be modified afterwards, or queries\n"
+            "run against the changed mesh with bounds of the old one. Pass copies to keep the arrays writable.",
+            py::arg("vertices"), py::arg("faces"))
+        .def("build_bvh", [](BVH& self, int depth, BuildMethod method, int n_bins, int max_leaf_size, int n_threads, NodeLayout layout,
+                             int morton_bits, bool refine, float duplication_budget, bool leaf_triangles) {
+            if (n_bins < 2) {
+                throw std::runtime_error("n_bins must be at least 2");
             }
-            if (stack_size_buf.itemsize != sizeof(int)) {
-                throw std::runtime_error("stack_size must have dtype int32");
+            if (morton_bits != 0 && morton_bits != 30 && morton_bits != 63) {
+                throw std::runtime_error("morton_bits must be 0, 30 or 63");
+            }
+            if (!(duplication_budget >= 0)) {
+                throw std::runtime_error("duplication_budget must be non-negative");
             }
 
-            if (stack_buf.ndim != 2) {
+            BuildParams params;
+            params.depth = depth;
+            params.method = method;
+            params.n_bins = n_bins;
+            params.max_leaf_size = max_leaf_size;
+            params.n_threads = n_threads;
+            params.layout = layout;
+            params.morton_bits = morton_bits;
+            params.refine = refine;
+            params.duplication_budget = duplication_budget;
+            params.leaf_triangles = leaf_triangles;
+            self.build_bvh(params);
+            return self.sah_cost();
+        }, py::arg("depth"), py::arg("method") = BuildMethod::BinnedSAH, py::arg("n_bins") = 32, py::arg("max_leaf_size") = 8, py::arg("n_threads") = 0, py::arg("layout") = NodeLayout::Flat,
+           py::arg("morton_bits") = 0, py::arg("refine") = false, py::arg("duplication_budget") = 0.3f,
+           py::arg("leaf_triangles") = false)
+        .def("finalize", [](BVH& self, NodeLayout layout) {
+            check_built(self);
+            self.finalize(layout);
+        }, py::arg("layout"))
+        .def("refit", [](BVH& self, Vec3Array vertices, float rebuild_fraction) {
+            if (vertices.ndim() != 2 || vertices.shape(1) != 3) {
+                throw std::runtime_error("vertices must have shape (V,3)");
+            }
+            if (rebuild_fraction < 0 || rebuild_fraction > 1) {
+                throw std::runtime_error("rebuild_fraction must be in [0, 1]");
+            }
+
+            Buffer<glm::vec3> buffer = view_array<glm::vec3>(vertices);
+            py::gil_scoped_release release;
+            return self.refit(std::move(buffer), rebuild_fraction);
+        },
+        "Moves the mesh to new (V,3) vertices and refits the tree, returns sah_growth(). Contiguous float32 vertices\n"
+        "are not copied: the BVH keeps using the given array, so it must not be modified afterwards until the next\n"
+        "refit. Pass a copy to keep writing into the same array between refits.",
+        py::arg("vertices"), py::arg("rebuild_fraction") = 0.0f)
+        .def("optimize", [](BVH& self, int max_iterations, double time_budget) {
+            if (max_iterations < 0) {
+                throw std::runtime_error("max_iterations must be non-negative");
+            }
+
+            // sah before, sah after, passes
+            py::gil_scoped_release release;
+            return self.optimize(max_iterations, time_budget);
+        }, py::arg("max_iterations") = 8, py::arg("time_budget") = 0.0)
+        .def("sah_growth", &BVH::sah_growth)
+        .def("save_as_obj", [](BVH& self, const std::string& filename) {
+            check_built(self);
+            self.save_as_obj(filename);
+        })
+        .def("save", &BVH::save, py::arg("path"))
+        .def("load", &BVH::load, py::arg("path"))
+        .def("intersect_leaves", [](BVH& self, Vec3Array ray_origins, Vec3Array ray_directions, py::object stack_size_object, py::object stack_object,
+                                    int n_threads, bool return_stats, bool packets) {
+            if (packets && return_stats) {
+                throw std::runtime_error("return_stats counts single rays, it can't be combined with packets");
+            }
+            int n_rays = check_rays(ray_origins, ray_directions);
+            auto stack_size = state_array<int>(stack_size_object, "stack_size", "int32");
+            auto stack = state_array<uint32_t>(stack_object, "stack", "uint32");
+            if (stack_size.ndim() != 1 || stack_size.shape(0) != n_rays) {
+                throw std::runtime_error("stack_size must have shape (N,)");
+            }
+            if (stack.ndim() != 2 || stack.shape(0) != n_rays) {
                 throw std::runtime_error("stack must have shape (N,stack_size)");
             }
-            if (stack_buf.itemsize != sizeof(uint32_t)) {
-                throw std::runtime_error("stack must have dtype uint32");
+            if (self.flat_nodes.empty()) {
+                throw std::runtime_error("BVH is not built");
             }
 
-            int given_stack_size = stack_buf.shape[1];
-            if (given_stack_size < self.max_depth) {
+            int given_stack_size = stack.shape(1);
+            if (given_stack_size < self.required_stack_size) {
                 throw std::runtime_error("Stack size too small!");
             }
-            if (ray_origins_buf.ndim != 2 || ray_origins_buf.shape[1] != 3) {
-                throw std::runtime_error("ray_origins must have shape (N,3)");
+
+            const glm::vec3 *ray_origins_ptr = (const glm::vec3 *) ray_origins.data();
+            const glm::vec3 *ray_directions_ptr = (const glm::vec3 *) ray_directions.data();
+            int *stack_size_ptr = stack_size.mutable_data();
+            uint32_t *stack_ptr = stack.mutable_data();
+
+            py::array_t<bool> mask({n_rays});
+            py::array_t<int> leaf_indices({n_rays});
+            py::array_t<float> t_enters({n_rays});
+            py::array_t<float> t_exits({n_rays});
+
+            bool *mask_ptr = mask.mutable_data();
+            int *leaf_indices_ptr = leaf_indices.mutable_data();
+            float *t_enters_ptr = t_enters.mutable_data();
+            float *t_exits_ptr = t_exits.mutable_data();
+            StatsArrays stats(return_stats ? n_rays : 0);
+
+            // every ray only touches its own stack and output slots, so chunks of rays run independently
+            parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+                if (packets) {
+                    LeafTarget out = {mask_ptr + begin, leaf_indices_ptr + begin, t_enters_ptr + begin, t_exits_ptr + begin};
+                    self.intersect_leaves_packets(end - begin, ray_origins_ptr + begin, ray_directions_ptr + begin, stack_size_ptr + begin,
+                                                  stack_ptr + (size_t) given_stack_size * begin, given_stack_size, out);
+                    return;
+                }
+
+                for (int i = begin; i < end; ++i) {
+                    TraversalStats ray_stats;
+                    auto [mask, leaf_index, t_enter, t_exit] = return_stats
+                        ? self.intersect_leaves(ray_origins_ptr[i], ray_directions_ptr[i], stack_size_ptr[i], stack_ptr + given_stack_size * i, ray_stats)
+                        : self.intersect_leaves(ray_origins_ptr[i], ray_directions_ptr[i], stack_size_ptr[i], stack_ptr + given_stack_size * i);
+                    if (return_stats) {
+                        stats.set(i, ray_stats);
+                    }
+
+                    mask_ptr[i] = mask;
+                    leaf_indices_ptr[i] = leaf_index;
+                    t_enters_ptr[i] = t_enter;
+                    t_exits_ptr[i] = t_exit;
+                }
+            });
+
+            if (return_stats) {
+                return py::make_tuple(mask, leaf_indices, t_enters, t_exits, stats.to_dict());
+            }
+            return py::make_tuple(mask, leaf_indices, t_enters, t_exits);
+        },
+        "Next leaf hit by every ray, resumed from its stack. Leaves come depth-first, the nearer child of every\n"
+        "binary node first; Wide4 and Wide8 layouts order all children of a wide node by t_enter instead, so\n"
+        "the same leaves may come in another order than with the other layouts.\n"
+        "packets=True traces rays that start a fresh traversal (stack_size 1, stack [0]) together in SIMD packets\n"
+        "with the same results and stacks; it pays off for coherent rays such as camera rays in small screen blocks.",
+        py::arg("ray_origins"), py::arg("ray_directions"), py::arg("stack_size"), py::arg("stack"), py::arg("n_threads") = 0,
+           py::arg("return_stats") = false, py::arg("packets") = false)
+        .def("intersect_leaves_stackless", [](BVH& self, Vec3Array ray_origins, Vec3Array ray_directions, py::object tokens_object,
+                                              int n_threads, bool return_stats) {
+            int n_rays = check_rays(ray_origins, ray_directions);
+            auto tokens = state_array<uint32_t>(tokens_object, "tokens", "uint32");
+            if (tokens.ndim() != 1 || tokens.shape(0) != n_rays) {
+                throw std::runtime_error("tokens must have shape (N,)");
             }
-            if (ray_origins_buf.itemsize != sizeof(float)) {
-                throw std::runtime_error("ray_origins must have dtype float32");
+            if (self.flat_nodes.empty()) {
+                throw std::runtime_error("BVH is not built");
             }
 
-            glm::vec3 *ray_origins_ptr = (glm::vec3 *) ray_origins.request().ptr;
-            glm::vec3 *ray_directions_ptr = (glm::vec3 *) ray_directions.request().ptr;
-            int *stack_size_ptr = (int *) stack_size.request().ptr;
-            uint32_t *stack_ptr = (uint32_t *) stack.request().ptr;
+            const glm::vec3 *ray_origins_ptr = (const glm::vec3 *) ray_origins.data();
+            const glm::vec3 *ray_directions_ptr = (const glm::vec3 *) ray_directions.data();
+            uint32_t *tokens_ptr = tokens.mutable_data();
 
             py::array_t<bool> mask({n_rays});
             py::array_t<int> leaf_indices({n_rays});
             py::array_t<float> t_enters({n_rays});
             py::array_t<float> t_exits({n_rays});
 
-            bool *mask_ptr = (bool *) mask.request().ptr;
-            int *leaf_indices_ptr = (int *) leaf_indices.request().ptr;
-            float *t_enters_ptr = (float *) t_enters.request().ptr;
-            float *t_exits_ptr = (float *) t_exits.request().ptr;
+            bool *mask_ptr = mask.mutable_data();
+            int *leaf_indices_ptr = leaf_indices.mutable_data();
+            float *t_enters_ptr = t_enters.mutable_data();
+            float *t_exits_ptr = t_exits.mutable_data();
+            StatsArrays stats(return_stats ? n_rays : 0);
+
+            parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    TraversalStats ray_stats;
+                    auto [mask, leaf_index, t_enter, t_exit] = return_stats
+                        ? self.intersect_leaves_stackless(ray_origins_ptr[i], ray_directions_ptr[i], tokens_ptr[i], ray_stats)
+                        : self.intersect_leaves_stackless(ray_origins_ptr[i], ray_directions_ptr[i], tokens_ptr[i]);
+                    if (return_stats) {
+                        stats.set(i, ray_stats);
+                    }
+
+                    mask_ptr[i] = mask;
+                    leaf_indices_ptr[i] = leaf_index;
+                    t_enters_ptr[i] = t_enter;
+                    t_exits_ptr[i] = t_exit;
+                }
+            });
+
+            if (return_stats) {
+                return py::make_tuple(mask, leaf_indices, t_enters, t_exits, stats.to_dict());
+            }
+            return py::make_tuple(mask, leaf_indices, t_enters, t_exits);
+        }, py::arg("ray_origins"), py::arg("ray_directions"), py::arg("tokens"), py::arg("n_threads") = 0, py::arg("return_stats") = false)
+        .def("intersect_all_leaves", &intersect_all_leaves<BVH>,
+             py::arg("ray_origins"), py::arg("ray_directions"), py::arg("max_hits") = 0, py::arg("n_threads") = 0, py::arg("return_stats") = false)
+        .def("closest_hit", &intersect_triangles<false, BVH>,
+             "Nearest triangle hit of every ray. packets=True traces neighbouring rays of the arrays together in SIMD\n"
+             "packets, which pays off for coherent rays such as camera rays in small screen blocks; hits agree with the\n"
+             "single-ray query up to rounding.",
+             py::arg("ray_origins"), py::arg("ray_directions"), py::arg("t_min") = 0.0f, py::arg("t_max") = INFINITY, py::arg("n_threads") = 0,
+             py::arg("return_stats") = false, py::arg("packets") = false)
+        .def("any_hit", &intersect_triangles<true, BVH>,
+             "Some triangle hit of every ray, for occlusion tests. packets=True as for closest_hit, a ray may then\n"
+             "return another of its hits.",
+             py::arg("ray_origins"), py::arg("ray_directions"), py::arg("t_min") = 0.0f, py::arg("t_max") = INFINITY, py::arg("n_threads") = 0,
+             py::arg("return_stats") = false, py::arg("packets") = false)
+        .def("closest_point", &closest_point,
+             py::arg("points"), py::arg("max_distance") = INFINITY, py::arg("n_threads") = 0, py::arg("return_stats") = false)
+        .def("query_aabb", [](BVH& self, Vec3Array mins, Vec3Array maxs, bool return_leaves, bool sort_queries, int n_threads) {
+            if (mins.ndim() != 2 || mins.shape(1) != 3 || maxs.ndim() != 2 || maxs.shape(1) != 3 || maxs.shape(0) != mins.shape(0)) {
+                throw std::runtime_error("mins and maxs must have shape (N,3)");
+            }
+            if (self.flat_nodes.empty()) {
+                throw std::runtime_error("BVH is not built");
+            }
 
-            for (int i = 0; i < n_rays; ++i) {
-                auto [mask, leaf_index, t_enter, t_exit] = self.intersect_leaves(
-                    ray_origins_ptr[i],
-                    ray_directions_ptr[i], 
-                    stack_size_ptr[i],
-                    stack_ptr + given_stack_size * i
-                );
+            std::vector<int64_t> offsets;
+            std::vector<int> ids;
+            {
+                py::gil_scoped_release release;
+                self.query_aabbs(mins.shape(0), (const glm::vec3 *) mins.data(), (const glm::vec3 *) maxs.data(), return_leaves, sort_queries, n_threads,
+                                 offsets, ids);
+            }
+            return py::make_tuple(py::array_t<int64_t>((ssize_t) offsets.size(), offsets.data()), py::array_t<int>((ssize_t) ids.size(), ids.data()));
+        }, py::arg("mins"), py::arg("maxs"), py::arg("return_leaves") = false, py::arg("sort_queries") = false, py::arg("n_threads") = 0)
+        .def("query_sphere", [](BVH& self, Vec3Array centers, py::array_t<float, py::array::c_style | py::array::forcecast> radii,
+                                bool return_leaves, bool sort_queries, int n_threads) {
+            if (centers.ndim() != 2 || centers.shape(1) != 3) {
+                throw std::runtime_error("centers must have shape (N,3)");
+            }
+            if (radii.ndim() != 1 || radii.shape(0) != centers.shape(0)) {
+                throw std::runtime_error("radii must have shape (N,)");
+            }
+            if (self.flat_nodes.empty()) {
+                throw std::runtime_error("BVH is not built");
+            }
 
-                mask_ptr[i] = mask;
-                leaf_indices_ptr[i] = leaf_index;
-                t_enters_ptr[i] = t_enter;
-                t_exits_ptr[i] = t_exit;
+            std::vector<int64_t> offsets;
+            std::vector<int> ids;
+            {
+                py::gil_scoped_release release;
+                self.query_spheres(centers.shape(0), (const glm::vec3 *) centers.data(), radii.data(), return_leaves, sort_queries, n_threads,
+                                   offsets, ids);
+            }
+            return py::make_tuple(py::array_t<int64_t>((ssize_t) offsets.size(), offsets.data()), py::array_t<int>((ssize_t) ids.size(), ids.data()));
+        }, py::arg("centers"), py::arg("radii"), py::arg("return_leaves") = false, py::arg("sort_queries") = false, py::arg("n_threads") = 0)
+        .def("render", [](BVH& self, const Camera& camera, int width, int height, RenderMode mode,
+                          py::object mask, py::object ids, py::object t_enter, py::object t_exit, int n_threads) {
+            RenderTarget target;
+            target.mask = image_pixels<bool>(mask, width, height, "mask", "bool");
+            target.id = image_pixels<int>(ids, width, height, "ids", "int32");
+            target.t_enter = image_pixels<float>(t_enter, width, height, "t_enter", "float32");
+            target.t_exit = image_pixels<float>(t_exit, width, height, "t_exit", "float32");
+            if (mode == RenderMode::ClosestHit && target.t_exit) {
+                throw std::runtime_error("t_exit is only written in FirstLeaf mode");
             }
 
-            return std::make_tuple(mask, leaf_indices, t_enters, t_exits);
+            py::gil_scoped_release release;
+            self.render(camera, width, height, mode, target, n_threads);
+        }, py::arg("camera"), py::arg("width"), py::arg("height"), py::arg("mode") = RenderMode::FirstLeaf,
+           py::arg("mask") = py::none(), py::arg("ids") = py::none(), py::arg("t_enter") = py::none(), py::arg("t_exit") = py::none(),
+           py::arg("n_threads") = 0)
+        .def_readonly("required_stack_size", &BVH::required_stack_size)
+        .def("depth", [](BVH& self) {
+            check_built(self);
+            return self.depth();
         })
-        .def("depth", py::overload_cast<>(&BVH::depth))
         .def("n_nodes", &BVH::n_nodes)
-        .def("n_leaves", py::overload_cast<>(&BVH::n_leaves))        
+        .def("n_leaves", [](BVH& self) {
+            check_built(self);
+            return self.n_leaves();
+        })
+        .def("sah_cost", [](BVH& self) {
+            check_built(self);
+            return self.sah_cost();
+        })
+        .def("tree_stats", [](BVH& self, bool epo) {
+            TreeStats stats;
+            {
+                py::gil_scoped_release release;
+                stats = self.tree_stats(epo);
+            }
+
+            py::dict result;
+            result["sah_cost"] = stats.sah_cost;
+            result["overlap"] = stats.overlap;
+            if (epo) {
+                result["epo"] = stats.epo;
+            } else {
+                result["epo"] = py::none();
+            }
+            result["leaf_sizes"] = py::array_t<int>((ssize_t) stats.leaf_sizes.size(), stats.leaf_sizes.data());
+            result["leaf_depths"] = py::array_t<int>((ssize_t) stats.leaf_depths.size(), stats.leaf_depths.data());
+            return result;
+        },
+        "SAH cost, sibling overlap and leaf size and depth histograms. epo=True also computes the end-point overlap,\n"
+        "which clips faces against every box they overlap and takes much longer than a build; it is None otherwise.",
+        py::arg("epo") = false)
         .def("get_bbox", [](BVH& self, int node) {
+            check_built(self);
+            if (node < 0 || node >= self.n_nodes()) {
+                throw std::out_of_range("node index out of range");
+            }
             auto [vmin, vmax] = self.get_bbox(node);
             return std::make_tuple(py::array_t<float>({3}, {sizeof(float)}, (float*)&vmin), py::array_t<float>({3}, {sizeof(float)}, (float*)&vmax));
+        })
+        .def("get_leaf_faces", [](BVH& self, int node) {
+            if (node < 0 || node >= self.n_nodes() || !self.flat_nodes[node].is_leaf()) {
+                throw std::runtime_error("node is not a leaf");
+            }
+
+            std::vector<Face> faces = self.get_leaf_faces(node);
+            py::array_t<uint32_t> result({(int) faces.size(), 3});
+            std::copy((uint32_t *) faces.data(), (uint32_t *) (faces.data() + faces.size()), (uint32_t *) result.request().ptr);
+            return result;
         });;
+
+    // the top level is rebuilt lazily by the first query after instances changed
+    py::class_<Scene>(m, "Scene",
+        "Instances of built BVHs placed by (3,4) object to world transforms. Queries return instance ids next to\n"
+        "the leaf and hit outputs of BVH; there is no return_stats, query the BVH of an instance for that.")
+        .def(py::init<>())
+        .def("add_instance", [](Scene& self, std::shared_ptr<BVH> bvh, py::array_t<float, py::array::c_style | py::array::forcecast> transform) {
+            float m[3][4];
+            read_transform(transform, m);
+            return self.add_instance(bvh, m);
+        }, py::arg("bvh"), py::arg("transform"))
+        .def("update_instance", [](Scene& self, int id, py::array_t<float, py::array::c_style | py::array::forcecast> transform) {
+            float m[3][4];
+            read_transform(transform, m);
+            self.update_instance(id, m);
+        }, py::arg("id"), py::arg("transform"))
+        .def("remove_instance", &Scene::remove_instance, py::arg("id"))
+        .def("build", &Scene::build)
+        .def("n_instances", &Scene::n_instances)
+        .def_property_readonly("required_stack_size", [](Scene& self) {
+            if (self.dirty) {
+                self.build();
+            }
+            return self.required_stack_size;
+        })
+        .def("intersect_leaves", [](Scene& self, Vec3Array ray_origins, Vec3Array ray_directions, py::object stack_size_object, py::object stack_object,
+                                    int n_threads) {
+            int n_rays = check_rays(ray_origins, ray_directions);
+            auto stack_size = state_array<int>(stack_size_object, "stack_size", "int32");
+            auto stack = state_array<uint32_t>(stack_object, "stack", "uint32");
+            if (stack_size.ndim() != 1 || stack_size.shape(0) != n_rays) {
+                throw std::runtime_error("stack_size must have shape (N,)");
+            }
+            if (stack.ndim() != 2 || stack.shape(0) != n_rays) {
+                throw std::runtime_error("stack must have shape (N,stack_size)");
+            }
+            if (self.dirty) {
+                self.build();
+            }
+
+            int given_stack_size = stack.shape(1);
+            if (given_stack_size < self.required_stack_size) {
+                throw std::runtime_error("Stack size too small!");
+            }
+
+            const glm::vec3 *ray_origins_ptr = (const glm::vec3 *) ray_origins.data();
+            const glm::vec3 *ray_directions_ptr = (const glm::vec3 *) ray_directions.data();
+            int *stack_size_ptr = stack_size.mutable_data();
+            uint32_t *stack_ptr = stack.mutable_data();
+
+            py::array_t<bool> mask({n_rays});
+            py::array_t<int> instance_ids({n_rays});
+            py::array_t<int> leaf_indices({n_rays});
+            py::array_t<float> t_enters({n_rays});
+            py::array_t<float> t_exits({n_rays});
+
+            bool *mask_ptr = mask.mutable_data();
+            int *instance_ids_ptr = instance_ids.mutable_data();
+            int *leaf_indices_ptr = leaf_indices.mutable_data();
+            float *t_enters_ptr = t_enters.mutable_data();
+            float *t_exits_ptr = t_exits.mutable_data();
+
+            parallel_for_rays(n_rays, n_threads, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    auto [mask, instance_id, leaf_index, t_enter, t_exit] =
+                        self.intersect_leaves(ray_origins_ptr[i], ray_directions_ptr[i], stack_size_ptr[i], stack_ptr + (size_t) given_stack_size * i);
+                    mask_ptr[i] = mask;
+                    instance_ids_ptr[i] = instance_id;
+                    leaf_indices_ptr[i] = leaf_index;
+                    t_enters_ptr[i] = t_enter;
+                    t_exits_ptr[i] = t_exit;
+                }
+            });
+
+            return py::make_tuple(mask, instance_ids, leaf_indices, t_enters, t_exits);
+        },
+        "Next bottom-level leaf hit by every ray and the id of its instance, resumed from its stack like\n"
+        "BVH.intersect_leaves. The stack needs required_stack_size columns; stacks are only valid until\n"
+        "instances change, since that rebuilds the top level.",
+        py::arg("ray_origins"), py::arg("ray_directions"), py::arg("stack_size"), py::arg("stack"), py::arg("n_threads") = 0)
+        .def("intersect_all_leaves", [](Scene& self, Vec3Array ray_origins, Vec3Array ray_directions, int max_hits, int n_threads) {
+            return intersect_all_leaves(self, ray_origins, ray_directions, max_hits, n_threads, false);
+        }, py::arg("ray_origins"), py::arg("ray_directions"), py::arg("max_hits") = 0, py::arg("n_threads") = 0)
+        .def("closest_hit", [](Scene& self, Vec3Array ray_origins, Vec3Array ray_directions, float t_min, float t_max, int n_threads) {
+            return intersect_triangles<false>(self, ray_origins, ray_directions, t_min, t_max, n_threads, false, false);
+        }, py::arg("ray_origins"), py::arg("ray_directions"), py::arg("t_min") = 0.0f, py::arg("t_max") = INFINITY, py::arg("n_threads") = 0)
+        .def("any_hit", [](Scene& self, Vec3Array ray_origins, Vec3Array ray_directions, float t_min, float t_max, int n_threads) {
+            return intersect_triangles<true>(self, ray_origins, ray_directions, t_min, t_max, n_threads, false, false);
+        }, py::arg("ray_origins"), py::arg("ray_directions"), py::arg("t_min") = 0.0f, py::arg("t_max") = INFINITY, py::arg("n_threads") = 0);
 }
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+// Array that either owns its elements or views memory owned by someone else (a mapped
+// file, a numpy array). `owner` keeps that memory alive for as long as any view exists.
+// Modifying the size of a view copies it into owned storage first, element writes go
+// straight to the viewed memory.
+template <typename T>
+class Buffer {
+public:
+    Buffer() {}
+
+    Buffer(const Buffer& other) : owned(other.owned), owner(other.owner) {
+        rebase(other);
+    }
+
+    Buffer(Buffer&& other) : owned(std::move(other.owned)), owner(std::move(other.owner)) {
+        rebase(other);
+        other.reset();
+    }
+
+    Buffer& operator=(const Buffer& other) {
+        if (this != &other) {
+            owned = other.owned;
+            owner = other.owner;
+            rebase(other);
+        }
+        return *this;
+    }
+
+    Buffer& operator=(Buffer&& other) {
+        if (this != &other) {
+            owned = std::move(other.owned);
+            owner = std::move(other.owner);
+            rebase(other);
+            other.reset();
+        }
+        return *this;
+    }
+
+    static Buffer view(const T *data, size_t n, std::shared_ptr<const void> owner) {
+        Buffer buffer;
+        buffer.ptr = const_cast<T *>(data);
+        buffer.n = n;
+        buffer.owner = std::move(owner);
+        return buffer;
+    }
+
+    bool is_view() const {
+        return owner != nullptr;
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    T *data() {
+        return ptr;
+    }
+    const T *data() const {
+        return ptr;
+    }
+
+    T& operator[](size_t i) {
+        return ptr[i];
+    }
+    const T& operator[](size_t i) const {
+        return ptr[i];
+    }
+
+    T *begin() {
+        return ptr;
+    }
+    T *end() {
+        return ptr + n;
+    }
+    const T *begin() const {
+        return ptr;
+    }
+    const T *end() const {
+        return ptr + n;
+    }
+
+    T& back() {
+        return ptr[n - 1];
+    }
+
+    void clear() {
+        owner.reset();
+        owned.clear();
+        sync();
+    }
+
+    void reserve(size_t capacity) {
+        own();
+        owned.reserve(capacity);
+        sync();
+    }
+
+    void resize(size_t size) {
+        own();
+        owned.resize(size);
+        sync();
+    }
+
+    void push_back(const T& value) {
+        own();
+        owned.push_back(value);
+        sync();
+    }
+
+    template <typename... Args>
+    void emplace_back(Args&&... args) {
+        own();
+        owned.emplace_back(std::forward<Args>(args)...);
+        sync();
+    }
+
+private:
+    std::vector<T> owned;
+    std::shared_ptr<const void> owner; // set for views only
+    T *ptr = nullptr;
+    size_t n = 0;
+
+    // copies viewed elements into owned storage
+    void own() {
+        if (owner) {
+            owned.assign(ptr, ptr + n);
+            owner.reset();
+        }
+    }
+
+    void sync() {
+        ptr = owned.data();
+        n = owned.size();
+    }
+
+    void rebase(const Buffer& other) {
+        if (owner) {
+            ptr = other.ptr;
+            n = other.n;
+        } else {
+            sync();
+        }
+    }
+
+    void reset() {
+        owned.clear();
+        owner.reset();
+        sync();
+    }
+};
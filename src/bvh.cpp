@@ -13,11 +13,33 @@
 #include <functional>
 #include <unordered_set>
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bvh.h"
+#include "thread_pool.h"
+#include "simd.h"
 
 
 void BVH::build_bvh(int depth) {
+    BuildParams params;
+    params.depth = depth;
+    build_bvh(params);
+}
+
+
+void BVH::build_bvh(const BuildParams& params) {
+    build_params = params;
+    max_depth = params.depth;
+
+    nodes.clear();
     nodes.push_back(BVHNode());
     BVHNode *root = &nodes[0];
 
@@ -30,14 +52,139 @@ void BVH::build_bvh(int depth) {
         root->max = glm::max(root->max, vertex);
     }
 
-    root->faces = mesh.faces;
+    root->first = 0;
+    root->count = mesh.faces.size();
+
+    prim_indices.resize(mesh.faces.size());
+
+    if (params.method == BuildMethod::Sweep) {
+        for (int i = 0; i < prim_indices.size(); i++) {
+            prim_indices[i] = i;
+        }
+
+        grow_bvh(0, params.depth);
+    } else if (params.method == BuildMethod::LBVH) {
+        build_bvh_lbvh(params);
+    } else if (params.method == BuildMethod::SBVH) {
+        build_bvh_sbvh(params);
+    } else {
+        build_bvh_binned(params);
+    }
+
+    finalize(params.layout);
+
+    build_sah = sah_cost();
+    build_costs.clear();
+}
+
+
+void BVH::compute_face_bounds(ThreadPool& pool, std::vector<FaceBounds>& bounds) {
+    bounds.resize(mesh.faces.size());
+    pool.parallel_for(0, mesh.faces.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const Face& face = mesh.faces[i];
+            FaceBounds& b = bounds[i];
+            b.min = glm::min(mesh.vertices[face.v1], glm::min(mesh.vertices[face.v2], mesh.vertices[face.v3]));
+            b.max = glm::max(mesh.vertices[face.v1], glm::max(mesh.vertices[face.v2], mesh.vertices[face.v3]));
+            b.centroid = (b.min + b.max) * 0.5f;
+        }
+    });
+}
+
+
+void BVH::build_bvh_binned(const BuildParams& params) {
+    ThreadPool& pool = shared_thread_pool(params.n_threads);
+
+    std::vector<FaceBounds> bounds;
+    compute_face_bounds(pool, bounds);
+    build_binned_over(pool, params, std::move(bounds));
+}
+
+
+void BVH::build_over_bounds(std::vector<FaceBounds> bounds, const BuildParams& params) {
+    build_params = params;
+    max_depth = params.depth;
+    mesh = Mesh();
+
+    nodes.clear();
+    nodes.push_back(BVHNode());
+    for (const FaceBounds& b : bounds) {
+        nodes[0].min = glm::min(nodes[0].min, b.min);
+        nodes[0].max = glm::max(nodes[0].max, b.max);
+    }
+    nodes[0].first = 0;
+    nodes[0].count = bounds.size();
+    prim_indices.resize(bounds.size());
+
+    ThreadPool& pool = shared_thread_pool(params.n_threads);
+    build_binned_over(pool, params, std::move(bounds));
+    finalize(params.layout);
+
+    build_sah = sah_cost();
+    build_costs.clear();
+}
+
+
+void BVH::build_binned_over(ThreadPool& pool, const BuildParams& params, std::vector<FaceBounds> bounds) {
+    int n = bounds.size();
+
+    BinnedBuild build;
+    build.bounds = std::move(bounds);
+    build.indices = prim_indices.data();
+    build.pool = pool.size() > 1 ? &pool : nullptr;
+
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            build.indices[i] = i;
+        }
+    });
+
+    if (!build.pool) {
+        grow_bvh_binned(nodes, 0, params.depth, build, 0, n);
+        return;
+    }
+
+    // top of the tree is split here with parallel binning, smaller subtrees become tasks
+    build.task_size = std::max(PARALLEL_TASK_MIN_FACES, n / (pool.size() * 8));
+    {
+        TaskGroup group(pool);
+        build.group = &group;
+        grow_bvh_binned(nodes, 0, params.depth, build, 0, n);
+        group.wait();
+    }
+
+    // every subtree was grown in its own node range, move them behind the top nodes
+    int total = nodes.size();
+    for (const BinnedBuild::Task& task : build.tasks) {
+        total += task.nodes.size() - 1;
+    }
+    nodes.reserve(total);
+
+    for (BinnedBuild::Task& task : build.tasks) {
+        splice_subtree(task.node, task.nodes);
+    }
+}
+
+
+void BVH::splice_subtree(int node, std::vector<BVHNode>& subtree) {
+    int offset = nodes.size() - 1; // local node 0 is the subtree root, which already lives in nodes
+
+    nodes[node].left = subtree[0].left == -1 ? -1 : subtree[0].left + offset;
+    nodes[node].right = subtree[0].right == -1 ? -1 : subtree[0].right + offset;
 
-    grow_bvh(0, depth);
+    for (int i = 1; i < subtree.size(); i++) {
+        BVHNode& child = subtree[i];
+        if (!child.is_leaf()) {
+            child.left += offset;
+            child.right += offset;
+        }
+        nodes.push_back(std::move(child));
+    }
 }
 
 
 float leaf_cost(const BVHNode& node) {
-    return node.faces.size() * TRIANGLE_INTERSECTION_COST;
+    return node.count * TRIANGLE_INTERSECTION_COST;
 }
 
 
@@ -52,15 +199,20 @@ float box_volume(const glm::vec3& min, const glm::vec3& max) {
 }
 
 
-float split_cost(const BVH& bvh, int node, int axis, const std::vector<Face>& faces_sorted, int split_i) {
+float split_cost(const BVH& bvh, int node, int axis, int split_i) {
     BVHNode left, right;
 
+    int count = bvh.nodes[node].count;
+    auto faces_sorted = [&](int i) {
+        return bvh.mesh.faces[bvh.prim_indices[bvh.nodes[node].first + i]];
+    };
+
     for (int j = 0; j < 3; ++j) {
-        left.min = glm::min(left.min, bvh.mesh.vertices[faces_sorted[0][j]]);
-        left.max = glm::max(left.max, bvh.mesh.vertices[faces_sorted[split_i - 1][j]]);
+        left.min = glm::min(left.min, bvh.mesh.vertices[faces_sorted(0)[j]]);
+        left.max = glm::max(left.max, bvh.mesh.vertices[faces_sorted(split_i - 1)[j]]);
 
-        right.min = glm::min(right.min, bvh.mesh.vertices[faces_sorted[split_i][j]]);
-        right.max = glm::max(right.max, bvh.mesh.vertices[faces_sorted[faces_sorted.size() - 1][j]]);
+        right.min = glm::min(right.min, bvh.mesh.vertices[faces_sorted(split_i)[j]]);
+        right.max = glm::max(right.max, bvh.mesh.vertices[faces_sorted(count - 1)[j]]);
     }
 
     float parent_area = (bvh.nodes[node].max - bvh.nodes[node].min)[axis];
@@ -76,7 +228,7 @@ float split_cost(const BVH& bvh, int node, int axis, const std::vector<Face>& fa
     // return box_area(left.min, left.max) + box_area(right.min, right.max);
 
     float left_cost = left_area / parent_area * split_i * TRIANGLE_INTERSECTION_COST;
-    float right_cost = right_area / parent_area * (faces_sorted.size() - split_i) * TRIANGLE_INTERSECTION_COST;
+    float right_cost = right_area / parent_area * (count - split_i) * TRIANGLE_INTERSECTION_COST;
 
     return TRAVERSAL_COST + left_cost + right_cost;
 }
@@ -85,7 +237,7 @@ float split_cost(const BVH& bvh, int node, int axis, const std::vector<Face>& fa
 void BVH::grow_bvh(int node, int depth) {
     BVHNode *root = &nodes[node];
 
-    if (depth <= 0 || root->faces.size() <= 1) {
+    if (depth <= 0 || root->count <= 1) {
         #ifdef DEBUG
         cout << "Child node min: " << root->min.x << " " << root->min.y << " " << root->min.z << endl;
         cout << "Child node max: " << root->max.x << " " << root->max.y << " " << root->max.z << endl;
@@ -104,8 +256,15 @@ void BVH::grow_bvh(int node, int depth) {
         axis = 2;
     }
 
-    std::vector<Face> faces_sorted = root->faces;
-    std::sort(faces_sorted.begin(), faces_sorted.end(), [&](Face a, Face b) {
+    int first = root->first;
+    int count = root->count;
+
+    // faces of the node are sorted in place, children take the two halves of the range
+    unsigned *faces_sorted = prim_indices.data() + first;
+    std::sort(faces_sorted, faces_sorted + count, [&](unsigned a_i, unsigned b_i) {
+        const Face& a = mesh.faces[a_i];
+        const Face& b = mesh.faces[b_i];
+
         glm::vec3 a_min = glm::vec3(FLT_MAX);
         glm::vec3 a_max = glm::vec3(-FLT_MAX);
         glm::vec3 b_min = glm::vec3(FLT_MAX);
@@ -126,10 +285,9 @@ void BVH::grow_bvh(int node, int depth) {
 
     float best_cost = FLT_MAX;
     int best_split_i = -1;
-    float cur_cost = leaf_cost(*root);
 
-    for (int i = 1; i < faces_sorted.size(); i++) {
-        float cost = split_cost(*this, node, axis, faces_sorted, i);
+    for (int i = 1; i < count; i++) {
+        float cost = split_cost(*this, node, axis, i);
         if (cost < best_cost) {
             best_cost = cost;
             best_split_i = i;
@@ -137,10 +295,10 @@ void BVH::grow_bvh(int node, int depth) {
     }
 
     int split_i = best_split_i;
-    // int split_i = faces_sorted.size() / 2;
+    // int split_i = count / 2;
 
     #ifdef DEBUG
-    cout << "Splitting at " << split_i << " out of " << faces_sorted.size() << endl;
+    cout << "Splitting at " << split_i << " out of " << count << endl;
     #endif
 
     BVHNode left;
@@ -151,44 +309,46 @@ void BVH::grow_bvh(int node, int depth) {
     right.min = glm::vec3(FLT_MAX);
     right.max = glm::vec3(-FLT_MAX);
 
+    left.first = first;
+    left.count = split_i;
     for (int i = 0; i < split_i; i++) {
-        Face face = faces_sorted[i];
+        Face face = mesh.faces[faces_sorted[i]];
         for (int j = 0; j < 3; j++) {
             glm::vec3 vertex = mesh.vertices[face[j]];
             left.min = glm::min(left.min, vertex);
             left.max = glm::max(left.max, vertex);
         }
-        left.faces.push_back(face);
     }
 
-    for (int i = split_i; i < faces_sorted.size(); i++) {
-        Face face = faces_sorted[i];
+    right.first = first + split_i;
+    right.count = count - split_i;
+    for (int i = split_i; i < count; i++) {
+        Face face = mesh.faces[faces_sorted[i]];
         for (int j = 0; j < 3; j++) {
             glm::vec3 vertex = mesh.vertices[face[j]];
             right.min = glm::min(right.min, vertex);
             right.max = glm::max(right.max, vertex);
         }
-        right.faces.push_back(face);
     }
 
     #ifdef DEBUG
     cout << "Current depth is " << depth << endl;
     cout << "Parent node min: " << root->min.x << " " << root->min.y << " " << root->min.z << endl;
     cout << "Parent node max: " << root->max.x << " " << root->max.y << " " << root->max.z << endl;
-    float split_coord = mesh.vertices[faces_sorted[split_i].v1][axis];
+    float split_coord = mesh.vertices[mesh.faces[faces_sorted[split_i]].v1][axis];
     cout << "Splitting at " << split_coord << " on axis " << axis << endl;
-    cout << "Number of faces left: " << left.faces.size() << endl;
-    cout << "Number of faces right: " << right.faces.size() << endl;
+    cout << "Number of faces left: " << left.count << endl;
+    cout << "Number of faces right: " << right.count << endl;
     cout << endl;
     #endif
 
-    if (left.faces.size() > 0) {
+    if (left.count > 0) {
         nodes.push_back(left);
         nodes[node].left = nodes.size() - 1;
         grow_bvh(nodes.size() - 1, depth - 1);
     }
 
-    if (right.faces.size() > 0) {
+    if (right.count > 0) {
         nodes.push_back(right);
         nodes[node].right = nodes.size() - 1;
         grow_bvh(nodes.size() - 1, depth - 1);
@@ -196,10 +356,671 @@ void BVH::grow_bvh(int node, int depth) {
 }
 
 
+struct Bin {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+    int count = 0;
+};
+
+
+struct BinnedSplit {
+    int axis = -1;
+    int bin = -1;
+    float cost = FLT_MAX;
+    glm::vec3 centroid_min, scale;
+};
+
+
+static int bin_index(const BinnedSplit& split, const glm::vec3& centroid, int n_bins) {
+    int axis = split.axis;
+    return std::min(n_bins - 1, (int) ((centroid[axis] - split.centroid_min[axis]) * split.scale[axis]));
+}
+
+
+// bins faces [first, first + count) on all three axes at once, in parallel chunks for large ranges
+static BinnedSplit find_binned_split(const BuildParams& params, BinnedBuild& build, const BVHNode& node, int first, int count) {
+    const int n_bins = params.n_bins;
+    bool parallel = build.pool && count >= PARALLEL_SPLIT_MIN_FACES;
+    int n_chunks = parallel ? (count + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN : 1;
+    int grain = parallel ? PARALLEL_GRAIN : count;
+
+    std::vector<Bin> chunk_bounds(n_chunks);
+    auto run = [&](auto f) {
+        if (parallel) {
+            build.pool->parallel_for(0, n_chunks, 1, [&](int begin, int end) {
+                for (int chunk = begin; chunk < end; chunk++) {
+                    f(chunk, first + chunk * grain, std::min(first + count, first + (chunk + 1) * grain));
+                }
+            });
+        } else {
+            f(0, first, first + count);
+        }
+    };
+
+    run([&](int chunk, int begin, int end) {
+        Bin& b = chunk_bounds[chunk];
+        for (int i = begin; i < end; i++) {
+            b.min = glm::min(b.min, build.bounds[build.indices[i]].centroid);
+            b.max = glm::max(b.max, build.bounds[build.indices[i]].centroid);
+        }
+    });
+
+    BinnedSplit split;
+    split.centroid_min = glm::vec3(FLT_MAX);
+    glm::vec3 centroid_max = glm::vec3(-FLT_MAX);
+    for (const Bin& b : chunk_bounds) {
+        split.centroid_min = glm::min(split.centroid_min, b.min);
+        centroid_max = glm::max(centroid_max, b.max);
+    }
+    glm::vec3 extent = centroid_max - split.centroid_min;
+    for (int axis = 0; axis < 3; axis++) {
+        split.scale[axis] = extent[axis] > 0 ? n_bins / extent[axis] : 0;
+    }
+
+    // bins of all three axes for every chunk, merged afterwards
+    std::vector<Bin> chunk_bins(n_chunks * 3 * n_bins);
+    run([&](int chunk, int begin, int end) {
+        Bin *bins = &chunk_bins[chunk * 3 * n_bins];
+        for (int i = begin; i < end; i++) {
+            const FaceBounds& b = build.bounds[build.indices[i]];
+            for (int axis = 0; axis < 3; axis++) {
+                int bin_i = std::min(n_bins - 1, (int) ((b.centroid[axis] - split.centroid_min[axis]) * split.scale[axis]));
+                Bin& bin = bins[axis * n_bins + bin_i];
+                bin.min = glm::min(bin.min, b.min);
+                bin.max = glm::max(bin.max, b.max);
+                bin.count++;
+            }
+        }
+    });
+
+    std::vector<Bin> bins(chunk_bins.begin(), chunk_bins.begin() + 3 * n_bins);
+    for (int chunk = 1; chunk < n_chunks; chunk++) {
+        for (int i = 0; i < 3 * n_bins; i++) {
+            const Bin& bin = chunk_bins[chunk * 3 * n_bins + i];
+            bins[i].min = glm::min(bins[i].min, bin.min);
+            bins[i].max = glm::max(bins[i].max, bin.max);
+            bins[i].count += bin.count;
+        }
+    }
+
+    std::vector<float> right_area(n_bins);
+    std::vector<int> right_count(n_bins);
+    float parent_area = box_area(node.min, node.max);
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0) {
+            continue;
+        }
+        const Bin *axis_bins = &bins[axis * n_bins];
+
+        // sweep from the right, so that split cost is evaluated in one pass from the left
+        Bin acc;
+        for (int i = n_bins - 1; i > 0; i--) {
+            acc.min = glm::min(acc.min, axis_bins[i].min);
+            acc.max = glm::max(acc.max, axis_bins[i].max);
+            acc.count += axis_bins[i].count;
+            right_area[i] = acc.count > 0 ? box_area(acc.min, acc.max) : 0;
+            right_count[i] = acc.count;
+        }
+
+        acc = Bin();
+        for (int i = 0; i < n_bins - 1; i++) {
+            acc.min = glm::min(acc.min, axis_bins[i].min);
+            acc.max = glm::max(acc.max, axis_bins[i].max);
+            acc.count += axis_bins[i].count;
+            if (acc.count == 0 || right_count[i + 1] == 0) {
+                continue;
+            }
+
+            float left_cost = box_area(acc.min, acc.max) * acc.count * TRIANGLE_INTERSECTION_COST;
+            float right_cost = right_area[i + 1] * right_count[i + 1] * TRIANGLE_INTERSECTION_COST;
+            float cost = TRAVERSAL_COST + (left_cost + right_cost) / std::max(parent_area, FLT_MIN);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = i;
+            }
+        }
+    }
+
+    return split;
+}
+
+
+// moves faces that go to the left child in front, returns their count
+static int partition_binned(const BuildParams& params, BinnedBuild& build, const BinnedSplit& split, int first, int count) {
+    auto goes_left = [&](unsigned i) {
+        return bin_index(split, build.bounds[i].centroid, params.n_bins) <= split.bin;
+    };
+
+    if (!build.pool || count < PARALLEL_SPLIT_MIN_FACES) {
+        unsigned *middle = std::partition(build.indices + first, build.indices + first + count, goes_left);
+        return middle - (build.indices + first);
+    }
+
+    // count left faces per chunk, then scatter each chunk into its slots of a temporary array
+    int n_chunks = (count + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    std::vector<int> left_offsets(n_chunks + 1, 0);
+    std::vector<int> right_offsets(n_chunks + 1, 0);
+
+    build.pool->parallel_for(0, n_chunks, 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk++) {
+            int chunk_end = std::min(first + count, first + (chunk + 1) * PARALLEL_GRAIN);
+            int n_left = 0;
+            for (int i = first + chunk * PARALLEL_GRAIN; i < chunk_end; i++) {
+                n_left += goes_left(build.indices[i]);
+            }
+            left_offsets[chunk + 1] = n_left;
+            right_offsets[chunk + 1] = chunk_end - (first + chunk * PARALLEL_GRAIN) - n_left;
+        }
+    });
+
+    for (int chunk = 0; chunk < n_chunks; chunk++) {
+        left_offsets[chunk + 1] += left_offsets[chunk];
+        right_offsets[chunk + 1] += right_offsets[chunk];
+    }
+    int left_count = left_offsets[n_chunks];
+
+    std::vector<unsigned> partitioned(count);
+    build.pool->parallel_for(0, n_chunks, 1, [&](int begin, int end) {
+        for (int chunk = begin; chunk < end; chunk++) {
+            int chunk_end = std::min(first + count, first + (chunk + 1) * PARALLEL_GRAIN);
+            int left = left_offsets[chunk];
+            int right = left_count + right_offsets[chunk];
+            for (int i = first + chunk * PARALLEL_GRAIN; i < chunk_end; i++) {
+                unsigned face = build.indices[i];
+                partitioned[goes_left(face) ? left++ : right++] = face;
+            }
+        }
+    });
+
+    build.pool->parallel_for(0, count, PARALLEL_GRAIN, [&](int begin, int end) {
+        std::copy(partitioned.begin() + begin, partitioned.begin() + end, build.indices + first + begin);
+    });
+
+    return left_count;
+}
+
+
+void BVH::grow_bvh_binned(std::vector<BVHNode>& out, int node, int depth, BinnedBuild& build, int first, int count) {
+    if (depth <= 0 || count <= 1) {
+        return;
+    }
+
+    // hand the subtree over to the pool, it will be merged into nodes after the build;
+    // only the top of the tree spawns tasks, subtrees grow serially in their own range
+    if (build.group && &out == &nodes && count < build.task_size) {
+        build.tasks.emplace_back();
+        BinnedBuild::Task *task = &build.tasks.back();
+        task->node = node;
+        task->nodes.push_back(out[node]);
+
+        build.group->run([this, task, depth, &build, first, count]() {
+            grow_bvh_binned(task->nodes, 0, depth, build, first, count);
+        });
+        return;
+    }
+
+    BinnedSplit split = find_binned_split(build_params, build, out[node], first, count);
+
+    // all centroids coincide, binning can't separate them
+    if (split.axis == -1) {
+        return;
+    }
+
+    if (split.cost >= count * TRIANGLE_INTERSECTION_COST && count <= build_params.max_leaf_size) {
+        return;
+    }
+
+    int left_count = partition_binned(build_params, build, split, first, count);
+
+    #ifdef DEBUG
+    cout << "Splitting " << count << " faces into " << left_count << " and " << count - left_count << " on axis " << split.axis << ", cost " << split.cost << endl;
+    #endif
+
+    // out may reallocate while children grow, so only indices are kept across recursion
+    auto make_child = [&](int child_first, int child_count) {
+        BVHNode child;
+        child.first = child_first;
+        child.count = child_count;
+        for (int i = child_first; i < child_first + child_count; i++) {
+            child.min = glm::min(child.min, build.bounds[build.indices[i]].min);
+            child.max = glm::max(child.max, build.bounds[build.indices[i]].max);
+        }
+        out.push_back(child);
+        return (int) out.size() - 1;
+    };
+
+    int left = make_child(first, left_count);
+    out[node].left = left;
+    grow_bvh_binned(out, left, depth - 1, build, first, left_count);
+
+    int right = make_child(first + left_count, count - left_count);
+    out[node].right = right;
+    grow_bvh_binned(out, right, depth - 1, build, first + left_count, count - left_count);
+}
+
+
+float BVH::sah_cost() {
+    if (flat_nodes[0].is_leaf() && flat_nodes[0].count == 0) {
+        return 0;
+    }
+    float root_area = box_area(flat_nodes[0].min, flat_nodes[0].max);
+    double cost = 0;
+
+    for (const FlatNode& node : flat_nodes) {
+        float area = box_area(node.min, node.max) / root_area;
+        if (node.is_leaf()) {
+            cost += area * node.count * TRIANGLE_INTERSECTION_COST;
+        } else {
+            cost += area * TRAVERSAL_COST;
+        }
+    }
+
+    return cost;
+}
+
+
+std::vector<Face> BVH::get_leaf_faces(int node) {
+    std::vector<Face> faces;
+    faces.reserve(flat_nodes[node].count);
+    for (int i = flat_nodes[node].offset; i < flat_nodes[node].offset + flat_nodes[node].count; i++) {
+        faces.push_back(mesh.faces[prim_indices[i]]);
+    }
+    return faces;
+}
+
+
+// 2^e as float, e must be in normal float exponent range
+static float exp2i(int e) {
+    uint32_t bits = (uint32_t) (e + 127) << 23;
+    float result;
+    std::memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+
+static QuantizationGrid root_grid(const FlatNode& root) {
+    const int q_max = 65535;
+
+    QuantizationGrid grid;
+    grid.origin = root.min;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = root.max[axis] - root.min[axis];
+        int e = extent > 0 ? (int) std::ceil(std::log2(extent / q_max)) : -126;
+        e = std::max(-126, std::min(127, e));
+        // make sure the top of the grid covers the root despite rounding of origin + q * cell
+        while (e < 127 && root.min[axis] + q_max * exp2i(e) < root.max[axis]) {
+            e++;
+        }
+        grid.cell[axis] = exp2i(e);
+    }
+    return grid;
+}
+
+
+// largest q in [0, q_max] with origin + q * cell <= x, or 0
+static int quantize_down(float x, float origin, float cell, int q_max) {
+    float q = std::floor((x - origin) / cell);
+    int lo = q >= 0 ? (int) std::min(q, (float) q_max) : 0;
+    while (lo > 0 && origin + lo * cell > x) {
+        lo--;
+    }
+    return lo;
+}
+
+
+// smallest q in [0, q_max] with origin + q * cell >= x, or q_max
+static int quantize_up(float x, float origin, float cell, int q_max) {
+    float q = std::ceil((x - origin) / cell);
+    int hi = q >= 0 ? (int) std::min(q, (float) q_max) : 0;
+    while (hi < q_max && origin + hi * cell < x) {
+        hi++;
+    }
+    return hi;
+}
+
+
+static QuantizedNode8 quantize_node8(const Buffer<FlatNode>& flat_nodes, const QuantizationGrid& grid, int i) {
+    const FlatNode& node = flat_nodes[i];
+
+    QuantizedNode8 qnode = {};
+    qnode.right = node.is_leaf() ? 0 : node.offset;
+    const FlatNode *children[2] = {&node, &node};
+    if (!node.is_leaf()) {
+        children[0] = &flat_nodes[i + 1];
+        children[1] = &flat_nodes[node.offset];
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        qnode.origin[axis] = quantize_down(node.min[axis], grid.origin[axis], grid.cell[axis], 65535);
+        float origin = grid.origin[axis] + qnode.origin[axis] * grid.cell[axis];
+
+        int scale = 0;
+        while (scale < 15 && origin + 255 * (grid.cell[axis] * (1 << scale)) < node.max[axis]) {
+            scale++;
+        }
+        qnode.scale |= scale << (4 * axis);
+        float cell = grid.cell[axis] * (1 << scale);
+
+        for (int c = 0; c < 2; c++) {
+            qnode.child_min[c][axis] = quantize_down(children[c]->min[axis], origin, cell, 255);
+            qnode.child_max[c][axis] = quantize_up(children[c]->max[axis], origin, cell, 255);
+        }
+    }
+
+    return qnode;
+}
+
+
+static QuantizedNode16 quantize_node16(const Buffer<FlatNode>& flat_nodes, const QuantizationGrid& grid, int i) {
+    const FlatNode& node = flat_nodes[i];
+
+    QuantizedNode16 qnode = {};
+    qnode.right = node.is_leaf() ? 0 : node.offset;
+    for (int axis = 0; axis < 3; axis++) {
+        qnode.min[axis] = quantize_down(node.min[axis], grid.origin[axis], grid.cell[axis], 65535);
+        qnode.max[axis] = quantize_up(node.max[axis], grid.origin[axis], grid.cell[axis], 65535);
+    }
+
+    return qnode;
+}
+
+
+// box of child c of qnodes[parent], which is qnodes[child]; a leaf is child 0 of itself.
+// Products of grid coordinates and power of two cells are exact, so these match the build.
+static std::tuple<glm::vec3, glm::vec3> quantized_box(const QuantizationGrid& grid, const std::vector<QuantizedNode8>& qnodes, uint32_t parent, int c, uint32_t child) {
+    const QuantizedNode8& node = qnodes[parent];
+    glm::vec3 origin = grid.origin + glm::vec3(node.origin[0], node.origin[1], node.origin[2]) * grid.cell;
+    glm::vec3 cell = grid.cell * glm::vec3(1 << (node.scale & 15), 1 << (node.scale >> 4 & 15), 1 << (node.scale >> 8 & 15));
+    glm::vec3 min(node.child_min[c][0], node.child_min[c][1], node.child_min[c][2]);
+    glm::vec3 max(node.child_max[c][0], node.child_max[c][1], node.child_max[c][2]);
+    return {origin + min * cell, origin + max * cell};
+}
+
+static std::tuple<glm::vec3, glm::vec3> quantized_box(const QuantizationGrid& grid, const std::vector<QuantizedNode16>& qnodes, uint32_t parent, int c, uint32_t child) {
+    const QuantizedNode16& node = qnodes[child];
+    glm::vec3 min(node.min[0], node.min[1], node.min[2]);
+    glm::vec3 max(node.max[0], node.max[1], node.max[2]);
+    return {grid.origin + min * grid.cell, grid.origin + max * grid.cell};
+}
+
+
+// Greedily opens the child with the largest surface area until a node has W children,
+// then does the same for every inner child. Returns the stack entries traversal may need.
+template <int W>
+static int collapse_wide(const std::vector<BVHNode>& nodes, std::vector<WideNode<W>>& wnodes, int wide, int binary) {
+    std::vector<int> children;
+    if (nodes[binary].is_leaf()) {
+        children.push_back(binary);
+    } else {
+        children.push_back(nodes[binary].left);
+        children.push_back(nodes[binary].right);
+    }
+
+    while (children.size() < W) {
+        int best = -1;
+        float best_area = -1;
+        for (int i = 0; i < children.size(); i++) {
+            const BVHNode& child = nodes[children[i]];
+            float area = box_area(child.min, child.max);
+            if (!child.is_leaf() && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+
+        int opened = children[best];
+        children[best] = nodes[opened].left;
+        children.insert(children.begin() + best + 1, nodes[opened].right);
+    }
+
+    int max_child_stack = 1;
+    wnodes[wide].n_children = children.size();
+    for (int i = 0; i < W; i++) {
+        bool used = i < children.size();
+        const BVHNode& child = nodes[used ? children[i] : binary];
+        wnodes[wide].min_x[i] = used ? child.min.x : 0;
+        wnodes[wide].min_y[i] = used ? child.min.y : 0;
+        wnodes[wide].min_z[i] = used ? child.min.z : 0;
+        wnodes[wide].max_x[i] = used ? child.max.x : 0;
+        wnodes[wide].max_y[i] = used ? child.max.y : 0;
+        wnodes[wide].max_z[i] = used ? child.max.z : 0;
+        wnodes[wide].child[i] = 0;
+        if (!used) {
+            continue;
+        }
+
+        if (child.is_leaf()) {
+            wnodes[wide].child[i] = children[i] | WIDE_LEAF;
+        } else {
+            int child_wide = wnodes.size();
+            wnodes.emplace_back();
+            wnodes[wide].child[i] = child_wide;
+            max_child_stack = std::max(max_child_stack, collapse_wide(nodes, wnodes, child_wide, children[i]));
+        }
+    }
+
+    // all siblings of the child being processed may wait on the stack
+    return children.size() - 1 + max_child_stack;
+}
+
+
+void BVH::finalize_flat() {
+    // depth-first order: pop the left child right after its parent, so it gets the next index
+    std::vector<BVHNode> ordered;
+    ordered.reserve(nodes.size());
+
+    std::vector<std::tuple<int, int, bool>> stack = {{0, -1, false}}; // node, new parent index, is right child
+    while (!stack.empty()) {
+        auto [node, parent, is_right] = stack.back();
+        stack.pop_back();
+
+        int new_i = ordered.size();
+        ordered.push_back(nodes[node]);
+        if (parent != -1) {
+            (is_right ? ordered[parent].right : ordered[parent].left) = new_i;
+        }
+
+        if (!nodes[node].is_leaf()) {
+            stack.push_back({nodes[node].right, new_i, true});
+            stack.push_back({nodes[node].left, new_i, false});
+        }
+    }
+    nodes = std::move(ordered);
+
+    // faces of the leaves are stored in depth-first order too, so every subtree covers one
+    // range of prim_indices even if the tree was restructured after the build
+    Buffer<unsigned> indices;
+    indices.resize(prim_indices.size());
+    int next = 0;
+    for (BVHNode& node : nodes) {
+        if (node.is_leaf()) {
+            std::copy(prim_indices.begin() + node.first, prim_indices.begin() + node.first + node.count, indices.begin() + next);
+            node.first = next;
+            next += node.count;
+        }
+    }
+    for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+        BVHNode& node = nodes[i];
+        if (!node.is_leaf()) {
+            node.first = nodes[node.left].first;
+            node.count = nodes[node.left].count + nodes[node.right].count;
+        }
+    }
+    prim_indices = std::move(indices);
+
+    // flat nodes are always kept, triangle queries traverse them whatever the layout is
+    flat_nodes.clear();
+    flat_nodes.resize(nodes.size());
+    for (int i = 0; i < nodes.size(); i++) {
+        const BVHNode& node = nodes[i];
+        FlatNode& flat = flat_nodes[i];
+        flat.min = node.min;
+        flat.max = node.max;
+        flat.offset = node.is_leaf() ? node.first : node.right;
+        flat.count = node.is_leaf() ? node.count : INNER_NODE;
+    }
+}
+
+
+// children always come after their parent in flat_nodes
+void BVH::restore_nodes() {
+    nodes.resize(flat_nodes.size());
+    for (int i = (int) flat_nodes.size() - 1; i >= 0; i--) {
+        const FlatNode& flat = flat_nodes[i];
+        BVHNode& node = nodes[i];
+        node.min = flat.min;
+        node.max = flat.max;
+        if (flat.is_leaf()) {
+            node.first = flat.offset;
+            node.count = flat.count;
+        } else {
+            node.left = i + 1;
+            node.right = flat.offset;
+            node.first = nodes[node.left].first;
+            node.count = nodes[node.left].count + nodes[node.right].count;
+        }
+    }
+}
+
+
+void BVH::finalize(NodeLayout layout) {
+    build_params.layout = layout;
+
+    // loaded trees only have flat nodes, which are depth-first already and stay mapped
+    if (nodes.empty()) {
+        restore_nodes();
+    } else {
+        finalize_flat();
+    }
+
+    // treelet restructuring may leave the tree deeper than the depth it was built with
+    max_depth = depth();
+    required_stack_size = max_depth + 1;
+    fill_parents();
+    fill_layout();
+}
+
+
+void BVH::fill_parents() {
+    parents.assign(flat_nodes.size(), 0);
+    for (int i = 0; i < flat_nodes.size(); i++) {
+        if (!flat_nodes[i].is_leaf()) {
+            parents[i + 1] = i;
+            parents[flat_nodes[i].offset] = i;
+        }
+    }
+}
+
+
+void BVH::fill_layout() {
+    quantized8_nodes.clear();
+    quantized16_nodes.clear();
+    wide4_nodes.clear();
+    wide8_nodes.clear();
+
+    switch (build_params.layout) {
+        case NodeLayout::Flat:
+            break;
+        case NodeLayout::Quantized8:
+            quantization_grid = root_grid(flat_nodes[0]);
+            quantized8_nodes.resize(flat_nodes.size());
+            for (int i = 0; i < flat_nodes.size(); i++) {
+                quantized8_nodes[i] = quantize_node8(flat_nodes, quantization_grid, i);
+            }
+            break;
+        case NodeLayout::Quantized16:
+            quantization_grid = root_grid(flat_nodes[0]);
+            quantized16_nodes.resize(flat_nodes.size());
+            for (int i = 0; i < flat_nodes.size(); i++) {
+                quantized16_nodes[i] = quantize_node16(flat_nodes, quantization_grid, i);
+            }
+            break;
+        case NodeLayout::Wide4:
+            wide4_nodes.emplace_back();
+            required_stack_size = collapse_wide(nodes, wide4_nodes, 0, 0);
+            break;
+        case NodeLayout::Wide8:
+            wide8_nodes.emplace_back();
+            required_stack_size = collapse_wide(nodes, wide8_nodes, 0, 0);
+            break;
+    }
+
+    fill_triangle_blocks();
+}
+
+
+void BVH::fill_triangle_blocks() {
+    triangle_blocks.clear();
+    leaf_blocks.clear();
+    if (!build_params.leaf_triangles) {
+        return;
+    }
+
+    leaf_blocks.resize(flat_nodes.size());
+    int n_blocks = 0;
+    for (int i = 0; i < flat_nodes.size(); i++) {
+        if (flat_nodes[i].is_leaf()) {
+            leaf_blocks[i] = n_blocks;
+            n_blocks += (flat_nodes[i].count + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+        }
+    }
+
+    triangle_blocks.resize(n_blocks);
+    for (int i = 0; i < flat_nodes.size(); i++) {
+        const FlatNode& node = flat_nodes[i];
+        if (!node.is_leaf()) {
+            continue;
+        }
+        for (int k = 0; k < node.count; k++) {
+            TriangleBlock& block = triangle_blocks[leaf_blocks[i] + k / TRIANGLE_BLOCK_SIZE];
+            int lane = k % TRIANGLE_BLOCK_SIZE;
+            const Face& f = mesh.faces[prim_indices[node.offset + k]];
+            glm::vec3 v0 = mesh.vertices[f.v1];
+            glm::vec3 e1 = mesh.vertices[f.v2] - v0;
+            glm::vec3 e2 = mesh.vertices[f.v3] - v0;
+            for (int axis = 0; axis < 3; axis++) {
+                block.v0[axis][lane] = v0[axis];
+                block.e1[axis][lane] = e1[axis];
+                block.e2[axis][lane] = e2[axis];
+            }
+            block.face[lane] = prim_indices[node.offset + k];
+        }
+    }
+}
+
+
 std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
 BVH::intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack) {
+    NoStats stats;
+    return intersect_leaves(o, d, stack_size, stack, stats);
+}
+
+
+template <typename Stats>
+std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+BVH::intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats) {
+    if (build_params.layout == NodeLayout::Quantized8) {
+        return intersect_leaves_quantized(quantized8_nodes, o, d, stack_size, stack, stats);
+    }
+    if (build_params.layout == NodeLayout::Quantized16) {
+        return intersect_leaves_quantized(quantized16_nodes, o, d, stack_size, stack, stats);
+    }
+    if (build_params.layout == NodeLayout::Wide4) {
+        return intersect_leaves_wide(wide4_nodes, o, d, stack_size, stack, stats);
+    }
+    if (build_params.layout == NodeLayout::Wide8) {
+        return intersect_leaves_wide(wide8_nodes, o, d, stack_size, stack, stats);
+    }
+
+    stats.stack(stack_size);
     if (stack_size == 1 && stack[0] == 0) {
-        auto [mask, t1, t2] = ray_box_intersection(o, d, nodes[0].min, nodes[0].max);
+        stats.test_boxes(1);
+        auto [mask, t1, t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
         if (!mask) {
             return {false, -1, 0, 0};
         }
@@ -207,19 +1028,162 @@ BVH::intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, u
 
     while (stack_size > 0) {
         uint32_t node_idx = stack[--stack_size];
+        const FlatNode& node = flat_nodes[node_idx];
+        stats.visit_node();
 
-        if (nodes[node_idx].is_leaf()) {
+        if (node.is_leaf()) {
             // redundant computation, yes I know
-            auto [mask, t1, t2] = ray_box_intersection(o, d, nodes[node_idx].min, nodes[node_idx].max);
+            stats.test_boxes(1);
+            stats.test_leaf();
+            auto [mask, t1, t2] = ray_box_intersection(o, d, node.min, node.max);
+
+            return {mask, node_idx, t1, t2};
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        stats.test_boxes(2);
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, flat_nodes[left].min, flat_nodes[left].max);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, flat_nodes[right].min, flat_nodes[right].max);
+
+        if (mask_l && mask_r && t1_l < t1_r) {
+            std::swap(left, right);
+            std::swap(t1_l, t1_r);
+            std::swap(t2_l, t2_r);
+        }
+
+        if (mask_l) {
+            stack[stack_size++] = left;
+        }
+
+        if (mask_r) {
+            stack[stack_size++] = right;
+        }
+        stats.stack(stack_size);
+    }
+
+    return {false, -1, 0, 0};
+}
+
+
+std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+BVH::intersect_leaves_stackless(const glm::vec3& o, const glm::vec3& d, uint32_t& token) {
+    NoStats stats;
+    return intersect_leaves_stackless(o, d, token, stats);
+}
+
+
+template <typename Stats>
+std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+BVH::intersect_leaves_stackless(const glm::vec3& o, const glm::vec3& d, uint32_t& token, Stats& stats) {
+    if (token == TRAVERSAL_DONE) {
+        return {false, -1, 0, 0};
+    }
+
+    // children of an inner node the ray hits, near first as intersect_leaves pops them, 0 for a miss
+    auto hit_children = [&](uint32_t node_idx, uint32_t& near, uint32_t& far) {
+        uint32_t left = node_idx + 1;
+        uint32_t right = flat_nodes[node_idx].offset;
+
+        stats.test_boxes(2);
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, flat_nodes[left].min, flat_nodes[left].max);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, flat_nodes[right].min, flat_nodes[right].max);
+
+        if (mask_l && mask_r) {
+            near = t1_l < t1_r ? left : right;
+            far = t1_l < t1_r ? right : left;
+        } else {
+            near = mask_l ? left : mask_r ? right : 0;
+            far = 0;
+        }
+    };
+
+    // the node visited after the subtree of node_idx: climb until coming up from a near child whose far sibling is hit
+    auto next_subtree = [&](uint32_t node_idx) {
+        while (node_idx != 0) {
+            uint32_t parent = parents[node_idx];
+            uint32_t near, far;
+            hit_children(parent, near, far);
+            if (node_idx == near && far != 0) {
+                return far;
+            }
+            node_idx = parent;
+        }
+        return TRAVERSAL_DONE;
+    };
+
+    uint32_t node_idx = token;
+    if (token == 0) {
+        stats.test_boxes(1);
+        auto [mask, t1, t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+        if (!mask) {
+            token = TRAVERSAL_DONE;
+            return {false, -1, 0, 0};
+        }
+    }
+
+    while (true) {
+        const FlatNode& node = flat_nodes[node_idx];
+        stats.visit_node();
+
+        if (node.is_leaf()) {
+            stats.test_boxes(1);
+            stats.test_leaf();
+            auto [mask, t1, t2] = ray_box_intersection(o, d, node.min, node.max);
+
+            token = next_subtree(node_idx);
+            return {mask, node_idx, t1, t2};
+        }
+
+        uint32_t near, far;
+        hit_children(node_idx, near, far);
+        node_idx = near != 0 ? near : next_subtree(node_idx);
+        if (node_idx == TRAVERSAL_DONE) {
+            token = TRAVERSAL_DONE;
+            return {false, -1, 0, 0};
+        }
+    }
+}
+
+
+template <typename Node, typename Stats>
+std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+BVH::intersect_leaves_quantized(const std::vector<Node>& qnodes, const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats) {
+    stats.stack(stack_size);
+    if (stack_size == 1 && stack[0] == 0) {
+        stats.test_boxes(1);
+        auto [mask, t1, t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+        if (!mask) {
+            return {false, -1, 0, 0};
+        }
+    }
+
+    while (stack_size > 0) {
+        uint32_t node_idx = stack[--stack_size];
+        const Node& node = qnodes[node_idx];
+        stats.visit_node();
+
+        if (node.is_leaf()) {
+            stats.test_boxes(1);
+            stats.test_leaf();
+            auto [min, max] = quantized_box(quantization_grid, qnodes, node_idx, 0, node_idx);
+            auto [mask, t1, t2] = ray_box_intersection(o, d, min, max);
+            if (!mask) {
+                continue;
+            }
 
             return {mask, node_idx, t1, t2};
         }
 
-        uint32_t left = nodes[node_idx].left;
-        uint32_t right = nodes[node_idx].right;
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.right;
 
-        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, nodes[left].min, nodes[left].max);
-        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, nodes[right].min, nodes[right].max);
+        auto [min_l, max_l] = quantized_box(quantization_grid, qnodes, node_idx, 0, left);
+        auto [min_r, max_r] = quantized_box(quantization_grid, qnodes, node_idx, 1, right);
+        stats.test_boxes(2);
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, min_l, max_l);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, min_r, max_r);
 
         if (mask_l && mask_r && t1_l < t1_r) {
             std::swap(left, right);
@@ -234,12 +1198,548 @@ BVH::intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, u
         if (mask_r) {
             stack[stack_size++] = right;
         }
+        stats.stack(stack_size);
+    }
+
+    return {false, -1, 0, 0};
+}
+
+
+template <int W, typename Stats>
+std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+BVH::intersect_leaves_wide(const std::vector<WideNode<W>>& wnodes, const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats) {
+    stats.stack(stack_size);
+    if (stack_size == 1 && stack[0] == 0) {
+        stats.test_boxes(1);
+        auto [mask, t1, t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+        if (!mask) {
+            return {false, -1, 0, 0};
+        }
+    }
+
+    vfloat<W> vo[3] = {vfloat<W>::broadcast(o.x), vfloat<W>::broadcast(o.y), vfloat<W>::broadcast(o.z)};
+    vfloat<W> vd[3] = {vfloat<W>::broadcast(d.x), vfloat<W>::broadcast(d.y), vfloat<W>::broadcast(d.z)};
+
+    while (stack_size > 0) {
+        uint32_t entry = stack[--stack_size];
+        stats.visit_node();
+
+        if (entry & WIDE_LEAF) {
+            uint32_t leaf = entry & ~WIDE_LEAF;
+            stats.test_boxes(1);
+            stats.test_leaf();
+            auto [mask, t1, t2] = ray_box_intersection(o, d, flat_nodes[leaf].min, flat_nodes[leaf].max);
+
+            return {mask, leaf, t1, t2};
+        }
+
+        const WideNode<W>& node = wnodes[entry];
+        stats.test_boxes(node.n_children);
+        vfloat<W> t_enter, t_exit;
+        uint32_t hits = ray_box_intersection<W>(
+            vo, vd,
+            node.min_x, node.min_y, node.min_z,
+            node.max_x, node.max_y, node.max_z,
+            t_enter, t_exit
+        );
+        hits &= (1u << node.n_children) - 1;
+
+        // push hit children from far to near, so that the nearest one is popped first
+        float hit_t[W];
+        uint32_t hit_child[W];
+        int n_hits = 0;
+        for (; hits; hits &= hits - 1) {
+            int i = __builtin_ctz(hits);
+            float t = t_enter[i];
+            int j = n_hits++;
+            for (; j > 0 && hit_t[j - 1] < t; j--) {
+                hit_t[j] = hit_t[j - 1];
+                hit_child[j] = hit_child[j - 1];
+            }
+            hit_t[j] = t;
+            hit_child[j] = node.child[i];
+        }
+
+        for (int i = 0; i < n_hits; i++) {
+            stack[stack_size++] = hit_child[i];
+        }
+        stats.stack(stack_size);
     }
 
     return {false, -1, 0, 0};
 }
 
 
+void BVH::intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits) {
+    NoStats stats;
+    intersect_all_leaves(o, d, max_hits, hits, stats);
+}
+
+
+template <typename Stats>
+void BVH::intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits, Stats& stats) {
+    stats.test_boxes(1);
+    auto [root_mask, root_t1, root_t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+    if (!root_mask) {
+        return;
+    }
+
+    int first = hits.size();
+    auto by_t_enter = [](const LeafHit& a, const LeafHit& b) {
+        return a.t_enter < b.t_enter;
+    };
+    // with a cap, hits[first:] is a max-heap of the nearest leaves found so far
+    auto full = [&]() {
+        return max_hits > 0 && (int) hits.size() - first == max_hits;
+    };
+
+    std::vector<uint32_t> stack;
+    stack.reserve(required_stack_size);
+    stack.push_back(0);
+
+    while (!stack.empty()) {
+        uint32_t node_idx = stack.back();
+        stack.pop_back();
+        const FlatNode& node = flat_nodes[node_idx];
+        stats.visit_node();
+
+        if (node.is_leaf()) {
+            stats.test_boxes(1);
+            stats.test_leaf();
+            auto [mask, t1, t2] = ray_box_intersection(o, d, node.min, node.max);
+            if (full()) {
+                if (t1 >= hits[first].t_enter) {
+                    continue;
+                }
+                std::pop_heap(hits.begin() + first, hits.end(), by_t_enter);
+                hits.pop_back();
+            }
+            hits.push_back({(int) node_idx, t1, t2});
+            if (max_hits > 0) {
+                std::push_heap(hits.begin() + first, hits.end(), by_t_enter);
+            }
+            continue;
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        stats.test_boxes(2);
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, flat_nodes[left].min, flat_nodes[left].max);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, flat_nodes[right].min, flat_nodes[right].max);
+
+        // subtrees starting behind the farthest kept leaf can't contribute
+        if (full()) {
+            mask_l = mask_l && t1_l < hits[first].t_enter;
+            mask_r = mask_r && t1_r < hits[first].t_enter;
+        }
+
+        if (mask_l && mask_r && t1_l < t1_r) {
+            std::swap(left, right);
+        }
+
+        if (mask_l) {
+            stack.push_back(left);
+        }
+
+        if (mask_r) {
+            stack.push_back(right);
+        }
+        stats.stack(stack.size());
+    }
+
+    std::sort(hits.begin() + first, hits.end(), by_t_enter);
+}
+
+
+template <bool AnyHit, typename Stats>
+std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+BVH::intersect_triangles(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, Stats& stats) {
+    bool found = false;
+    int face = -1;
+    float t_best = t_max, u_best = 0, v_best = 0;
+
+    stats.test_boxes(1);
+    auto [root_mask, root_t1, root_t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+    if (!root_mask || root_t1 > t_best || root_t2 < t_min) {
+        return {false, -1, t_max, 0, 0};
+    }
+
+    // nodes are pushed with their entry distance, so that they can be skipped once a closer hit is found
+    uint32_t local_stack[64];
+    float local_t[64];
+    std::vector<uint32_t> heap_stack;
+    std::vector<float> heap_t;
+    uint32_t *stack = local_stack;
+    float *stack_t = local_t;
+    if (required_stack_size > 64) {
+        heap_stack.resize(required_stack_size);
+        heap_t.resize(required_stack_size);
+        stack = heap_stack.data();
+        stack_t = heap_t.data();
+    }
+
+    // broadcast once for the triangle blocks
+    vfloat<TRIANGLE_BLOCK_SIZE> ray_o[3], ray_d[3];
+    for (int axis = 0; axis < 3; axis++) {
+        ray_o[axis] = vfloat<TRIANGLE_BLOCK_SIZE>::broadcast(o[axis]);
+        ray_d[axis] = vfloat<TRIANGLE_BLOCK_SIZE>::broadcast(d[axis]);
+    }
+
+    int stack_size = 0;
+    stack[stack_size] = 0;
+    stack_t[stack_size++] = root_t1;
+
+    while (stack_size > 0) {
+        stack_size--;
+        uint32_t node_idx = stack[stack_size];
+        if (stack_t[stack_size] > t_best) {
+            continue;
+        }
+        const FlatNode& node = flat_nodes[node_idx];
+        stats.visit_node();
+
+        if (node.is_leaf() && !triangle_blocks.empty()) {
+            stats.test_leaf();
+            const TriangleBlock *block = &triangle_blocks[leaf_blocks[node_idx]];
+            for (int first = 0; first < node.count; first += TRIANGLE_BLOCK_SIZE, block++) {
+                vfloat<TRIANGLE_BLOCK_SIZE> v0[3], e1[3], e2[3], t, u, v;
+                for (int axis = 0; axis < 3; axis++) {
+                    v0[axis] = vfloat<TRIANGLE_BLOCK_SIZE>::load(block->v0[axis]);
+                    e1[axis] = vfloat<TRIANGLE_BLOCK_SIZE>::load(block->e1[axis]);
+                    e2[axis] = vfloat<TRIANGLE_BLOCK_SIZE>::load(block->e2[axis]);
+                }
+                for (int lane = 0; lane < std::min<int>(TRIANGLE_BLOCK_SIZE, node.count - first); lane++) {
+                    stats.test_triangle();
+                }
+                uint32_t hits = ray_triangle_intersection<TRIANGLE_BLOCK_SIZE>(ray_o, ray_d, v0, e1, e2, t, u, v);
+
+                // lanes in face order, as the scalar loop below takes them
+                for (; hits; hits &= hits - 1) {
+                    int lane = __builtin_ctz(hits);
+                    if (t[lane] < t_min || t[lane] > t_best) {
+                        continue;
+                    }
+
+                    found = true;
+                    face = block->face[lane];
+                    t_best = t[lane];
+                    u_best = u[lane];
+                    v_best = v[lane];
+                    if (AnyHit) {
+                        return {true, face, t_best, u_best, v_best};
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (node.is_leaf()) {
+            stats.test_leaf();
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                const Face& f = mesh.faces[prim_indices[i]];
+                stats.test_triangle();
+                auto [hit, t, u, v] = ray_triangle_intersection(o, d, mesh.vertices[f.v1], mesh.vertices[f.v2], mesh.vertices[f.v3]);
+                if (!hit || t < t_min || t > t_best) {
+                    continue;
+                }
+
+                found = true;
+                face = prim_indices[i];
+                t_best = t;
+                u_best = u;
+                v_best = v;
+                if (AnyHit) {
+                    return {true, face, t_best, u_best, v_best};
+                }
+            }
+            continue;
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        stats.test_boxes(2);
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, flat_nodes[left].min, flat_nodes[left].max);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, flat_nodes[right].min, flat_nodes[right].max);
+        mask_l = mask_l && t1_l <= t_best && t2_l >= t_min;
+        mask_r = mask_r && t1_r <= t_best && t2_r >= t_min;
+
+        if (mask_l && mask_r && t1_l < t1_r) {
+            std::swap(left, right);
+            std::swap(t1_l, t1_r);
+        }
+
+        if (mask_l) {
+            stack[stack_size] = left;
+            stack_t[stack_size++] = t1_l;
+        }
+
+        if (mask_r) {
+            stack[stack_size] = right;
+            stack_t[stack_size++] = t1_r;
+        }
+        stats.stack(stack_size);
+    }
+
+    return {found, face, t_best, u_best, v_best};
+}
+
+
+std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+BVH::closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max) {
+    NoStats stats;
+    return intersect_triangles<false>(o, d, t_min, t_max, stats);
+}
+
+
+std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+BVH::closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, TraversalStats& stats) {
+    return intersect_triangles<false>(o, d, t_min, t_max, stats);
+}
+
+
+std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+BVH::any_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max) {
+    NoStats stats;
+    return intersect_triangles<true>(o, d, t_min, t_max, stats);
+}
+
+
+std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+BVH::any_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, TraversalStats& stats) {
+    return intersect_triangles<true>(o, d, t_min, t_max, stats);
+}
+
+
+template std::tuple<bool, int, float, float> BVH::intersect_leaves(const glm::vec3&, const glm::vec3&, int&, uint32_t*, TraversalStats&);
+template std::tuple<bool, int, float, float> BVH::intersect_leaves_stackless(const glm::vec3&, const glm::vec3&, uint32_t&, TraversalStats&);
+template void BVH::intersect_all_leaves(const glm::vec3&, const glm::vec3&, int, std::vector<LeafHit>&, TraversalStats&);
+
+
+const char BVH_FILE_MAGIC[8] = {'B', 'V', 'H', 'D', 'U', 'M', 'P', '\0'};
+const uint32_t BVH_FILE_VERSION = 4;
+const uint64_t BVH_FILE_ALIGNMENT = 64; // sections start on cache line boundaries
+
+
+// Header of a file written by BVH::save. Sections follow at the given byte offsets and
+// are stored exactly as they are in memory, so the file only loads on the same platform.
+struct BVHFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flat_node_size; // sizeof(FlatNode) of the writer
+
+    int32_t method, depth, n_bins, max_leaf_size;
+    int32_t layout;
+    int32_t required_stack_size;
+    int32_t tree_depth;      // depth() of the stored tree, may exceed depth after restructuring
+    int32_t n_threads, morton_bits, refine, leaf_triangles;
+    float duplication_budget;
+
+    uint64_t n_vertices, vertices_offset;
+    uint64_t n_faces, faces_offset;
+    uint64_t n_prim_indices, prim_indices_offset;
+    uint64_t n_flat_nodes, flat_nodes_offset;
+};
+
+
+void BVH::save(const std::string& path) {
+    if (flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+
+    BVHFileHeader header = {};
+    std::memcpy(header.magic, BVH_FILE_MAGIC, sizeof(header.magic));
+    header.version = BVH_FILE_VERSION;
+    header.flat_node_size = sizeof(FlatNode);
+    header.method = (int32_t) build_params.method;
+    header.depth = build_params.depth;
+    header.n_bins = build_params.n_bins;
+    header.max_leaf_size = build_params.max_leaf_size;
+    header.layout = (int32_t) build_params.layout;
+    header.required_stack_size = required_stack_size;
+    header.tree_depth = depth();
+    header.n_threads = build_params.n_threads;
+    header.morton_bits = build_params.morton_bits;
+    header.refine = build_params.refine;
+    header.leaf_triangles = build_params.leaf_triangles;
+    header.duplication_budget = build_params.duplication_budget;
+
+    uint64_t offset = sizeof(BVHFileHeader);
+    auto section = [&](uint64_t n, uint64_t item_size, uint64_t& n_out, uint64_t& offset_out) {
+        offset = (offset + BVH_FILE_ALIGNMENT - 1) / BVH_FILE_ALIGNMENT * BVH_FILE_ALIGNMENT;
+        n_out = n;
+        offset_out = offset;
+        offset += n * item_size;
+    };
+    section(mesh.vertices.size(), sizeof(glm::vec3), header.n_vertices, header.vertices_offset);
+    section(mesh.faces.size(), sizeof(Face), header.n_faces, header.faces_offset);
+    section(prim_indices.size(), sizeof(unsigned), header.n_prim_indices, header.prim_indices_offset);
+    section(flat_nodes.size(), sizeof(FlatNode), header.n_flat_nodes, header.flat_nodes_offset);
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+
+    auto write_at = [&](uint64_t at, const void *data, uint64_t size) {
+        static const char zeros[BVH_FILE_ALIGNMENT] = {};
+        file.write(zeros, at - (uint64_t) file.tellp());
+        file.write((const char *) data, size);
+    };
+    write_at(0, &header, sizeof(header));
+    write_at(header.vertices_offset, mesh.vertices.data(), header.n_vertices * sizeof(glm::vec3));
+    write_at(header.faces_offset, mesh.faces.data(), header.n_faces * sizeof(Face));
+    write_at(header.prim_indices_offset, prim_indices.data(), header.n_prim_indices * sizeof(unsigned));
+    write_at(header.flat_nodes_offset, flat_nodes.data(), header.n_flat_nodes * sizeof(FlatNode));
+
+    if (!file) {
+        throw std::runtime_error("Failed to write file: " + path);
+    }
+}
+
+
+// view of n items of type T at `offset` of a mapped file, checked against the file size
+template <typename T>
+static Buffer<T> map_section(const std::shared_ptr<const void>& mapping, uint64_t file_size, uint64_t n, uint64_t offset, const std::string& path) {
+    if (offset % alignof(T) != 0 || offset > file_size || n > (file_size - offset) / sizeof(T)) {
+        throw std::runtime_error("Truncated BVH file: " + path);
+    }
+    return Buffer<T>::view((const T *) ((const char *) mapping.get() + offset), n, mapping);
+}
+
+
+// Checks every index in a mapped file once, so that a corrupted file that passed the header
+// checks can't make queries read out of bounds. The nodes must form a tree in depth-first order
+// no deeper than max_depth, so that recursive walks over it can't overflow the stack.
+// Returns the depth of the tree.
+static int check_indices(const Buffer<glm::vec3>& vertices, const Buffer<Face>& faces, const Buffer<unsigned>& indices,
+                         const Buffer<FlatNode>& flat, int max_depth, const std::string& path) {
+    for (const Face& face : faces) {
+        if (face.v1 >= vertices.size() || face.v2 >= vertices.size() || face.v3 >= vertices.size()) {
+            throw std::runtime_error("Corrupted BVH file, face index out of range: " + path);
+        }
+    }
+    for (unsigned index : indices) {
+        if (index >= faces.size()) {
+            throw std::runtime_error("Corrupted BVH file, primitive index out of range: " + path);
+        }
+    }
+
+    // children come after their parent and every node but the root has exactly one parent,
+    // so the depth of every node is known before its children are reached
+    std::vector<uint8_t> n_parents(flat.size());
+    std::vector<int> node_depth(flat.size());
+    int depth = 0;
+    for (uint64_t i = 0; i < flat.size(); i++) {
+        const FlatNode& node = flat[i];
+        if (node.is_leaf()) {
+            if ((uint64_t) node.offset + node.count > indices.size()) {
+                throw std::runtime_error("Corrupted BVH file, leaf range out of range: " + path);
+            }
+            continue;
+        }
+        if (i + 1 >= flat.size() || node.offset <= i + 1 || node.offset >= flat.size()) {
+            throw std::runtime_error("Corrupted BVH file, child index out of range: " + path);
+        }
+        if (node_depth[i] >= max_depth) {
+            throw std::runtime_error("Corrupted BVH file, tree deeper than stored: " + path);
+        }
+        for (uint64_t child : {i + 1, (uint64_t) node.offset}) {
+            if (n_parents[child]++ != 0) {
+                throw std::runtime_error("Corrupted BVH file, node with several parents: " + path);
+            }
+            node_depth[child] = node_depth[i] + 1;
+        }
+        depth = std::max(depth, node_depth[i] + 1);
+    }
+    for (uint64_t i = 1; i < flat.size(); i++) {
+        if (n_parents[i] != 1) {
+            throw std::runtime_error("Corrupted BVH file, unreachable node: " + path);
+        }
+    }
+    return depth;
+}
+
+
+void BVH::load(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(BVHFileHeader)) {
+        close(fd);
+        throw std::runtime_error("Not a BVH file: " + path);
+    }
+
+    // private writable mapping: pages stay shared with the page cache until someone writes to them
+    uint64_t file_size = st.st_size;
+    void *data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map file: " + path);
+    }
+    std::shared_ptr<const void> mapping((const void *) data, [file_size](const void *p) {
+        munmap(const_cast<void *>(p), file_size);
+    });
+
+    const BVHFileHeader& header = *(const BVHFileHeader *) data;
+    if (std::memcmp(header.magic, BVH_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("Not a BVH file: " + path);
+    }
+    if (header.version != BVH_FILE_VERSION) {
+        throw std::runtime_error("Unsupported BVH file version " + std::to_string(header.version) + ": " + path);
+    }
+    if (header.flat_node_size != sizeof(FlatNode) || header.n_flat_nodes == 0) {
+        throw std::runtime_error("Incompatible BVH file: " + path);
+    }
+
+    Buffer<glm::vec3> vertices = map_section<glm::vec3>(mapping, file_size, header.n_vertices, header.vertices_offset, path);
+    Buffer<Face> faces = map_section<Face>(mapping, file_size, header.n_faces, header.faces_offset, path);
+    Buffer<unsigned> indices = map_section<unsigned>(mapping, file_size, header.n_prim_indices, header.prim_indices_offset, path);
+    Buffer<FlatNode> flat = map_section<FlatNode>(mapping, file_size, header.n_flat_nodes, header.flat_nodes_offset, path);
+    int tree_depth = check_indices(vertices, faces, indices, flat, header.tree_depth, path);
+    if (header.layout < (int32_t) NodeLayout::Flat || header.layout > (int32_t) NodeLayout::Wide8
+        || header.method < (int32_t) BuildMethod::Sweep || header.method > (int32_t) BuildMethod::SBVH) {
+        throw std::runtime_error("Corrupted BVH file, unknown method or layout: " + path);
+    }
+
+    mesh.vertices = std::move(vertices);
+    mesh.faces = std::move(faces);
+    prim_indices = std::move(indices);
+    flat_nodes = std::move(flat);
+    nodes.clear();
+    quantized8_nodes.clear();
+    quantized16_nodes.clear();
+    wide4_nodes.clear();
+    wide8_nodes.clear();
+
+    build_params.method = (BuildMethod) header.method;
+    build_params.depth = header.depth;
+    build_params.n_bins = header.n_bins;
+    build_params.max_leaf_size = header.max_leaf_size;
+    build_params.n_threads = header.n_threads;
+    build_params.morton_bits = header.morton_bits;
+    build_params.refine = header.refine;
+    build_params.duplication_budget = header.duplication_budget;
+    build_params.leaf_triangles = header.leaf_triangles;
+    build_params.layout = NodeLayout::Flat;
+    max_depth = tree_depth;
+    build_sah = 0;
+    build_costs.clear();
+    required_stack_size = max_depth + 1;
+    fill_parents();
+
+    // only flat nodes are stored, other layouts and triangle blocks are rebuilt from them
+    if (header.layout != (int32_t) NodeLayout::Flat) {
+        finalize((NodeLayout) header.layout);
+    } else {
+        fill_triangle_blocks();
+    }
+}
+
+
 void BVH::save_as_obj(const std::string& filename) {
     std::ofstream outFile(filename);
 
@@ -275,16 +1775,15 @@ void BVH::save_as_obj(const std::string& filename) {
 
     // Recursive function to traverse the BVH and write leaf nodes
     std::function<void(int)> traverseAndWrite = [&](int node) {
-        if (node == -1) return;
-
-        if (nodes[node].is_leaf()) {
+        if (flat_nodes[node].is_leaf()) {
             // Leaf node: write its bounding box as a cube
-            writeCube(nodes[node].min, nodes[node].max);
+            writeCube(flat_nodes[node].min, flat_nodes[node].max);
+            return;
         }
 
         // Recursively traverse children
-        traverseAndWrite(nodes[node].left);
-        traverseAndWrite(nodes[node].right);
+        traverseAndWrite(node + 1);
+        traverseAndWrite(flat_nodes[node].offset);
     };
 
     // Start traversal and writing
@@ -311,4 +1810,77 @@ ray_box_intersection(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &mi
     }
 
     return {true, t_enter, t_exit};
-}
\ No newline at end of file
+}
+
+
+// Möller–Trumbore, hit point is (1 - u - v) * v0 + u * v1 + v * v2
+std::tuple<bool, float, float, float> // mask, t, u, v
+ray_triangle_intersection(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2) {
+    glm::vec3 e1 = v1 - v0;
+    glm::vec3 e2 = v2 - v0;
+
+    glm::vec3 p = glm::cross(d, e2);
+    float det = glm::dot(e1, p);
+    if (det == 0) {
+        return {false, 0, 0, 0};
+    }
+    float inv_det = 1.0f / det;
+
+    glm::vec3 s = o - v0;
+    float u = glm::dot(s, p) * inv_det;
+    if (u < 0 || u > 1) {
+        return {false, 0, 0, 0};
+    }
+
+    glm::vec3 q = glm::cross(s, e1);
+    float v = glm::dot(d, q) * inv_det;
+    if (v < 0 || u + v > 1) {
+        return {false, 0, 0, 0};
+    }
+
+    float t = glm::dot(e2, q) * inv_det;
+    return {true, t, u, v};
+}
+
+
+// Sutherland-Hodgman against the six box planes, each plane adds at most one vertex
+int clip_triangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &min, const glm::vec3 &max, glm::vec3 out[9]) {
+    glm::vec3 buffer[9];
+    glm::vec3 *poly = out, *next = buffer;
+    poly[0] = v0;
+    poly[1] = v1;
+    poly[2] = v2;
+    int n = 3;
+
+    for (int plane = 0; plane < 6 && n > 0; plane++) {
+        int axis = plane % 3;
+        bool upper = plane >= 3;
+        float bound = upper ? max[axis] : min[axis];
+        auto inside = [&](const glm::vec3& p) {
+            return upper ? p[axis] <= bound : p[axis] >= bound;
+        };
+
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            const glm::vec3& a = poly[i];
+            const glm::vec3& b = poly[(i + 1) % n];
+            bool a_in = inside(a), b_in = inside(b);
+            if (a_in) {
+                next[m++] = a;
+            }
+            if (a_in != b_in) {
+                float t = (bound - a[axis]) / (b[axis] - a[axis]);
+                glm::vec3 p = a + t * (b - a);
+                p[axis] = bound;
+                next[m++] = p;
+            }
+        }
+        std::swap(poly, next);
+        n = m;
+    }
+
+    if (poly != out) {
+        std::copy(poly, poly + n, out);
+    }
+    return n;
+}
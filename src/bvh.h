@@ -1,3 +1,5 @@
+#pragma once
+
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -11,6 +13,9 @@
 #include <functional>
 #include <unordered_set>
 #include <algorithm>
+#include <deque>
+
+#include "buffer.h"
 
 
 using std::cin, std::cout, std::endl;
@@ -19,6 +24,10 @@ using std::cin, std::cout, std::endl;
 const float TRIANGLE_INTERSECTION_COST = 1.0f;
 const float TRAVERSAL_COST = 1.0f;
 
+const int PARALLEL_GRAIN = 1 << 14;           // items per chunk in parallel loops
+const int PARALLEL_SPLIT_MIN_FACES = 1 << 16; // smaller nodes are binned and partitioned by one thread
+const int PARALLEL_TASK_MIN_FACES = 1 << 12;  // smaller subtrees are never split into separate tasks
+
 
 struct Face {
     unsigned v1, v2, v3;
@@ -35,8 +44,8 @@ struct Face {
 
 
 struct Mesh {
-    std::vector<glm::vec3> vertices;
-    std::vector<Face> faces;
+    Buffer<glm::vec3> vertices;
+    Buffer<Face> faces;
 
     Mesh() {}
 
@@ -52,23 +61,37 @@ struct Mesh {
             exit(1);
         }
 
+        size_t n_vertices = 0;
+        size_t n_faces = 0;
+        for (int mesh_i = 0; mesh_i < scene->mNumMeshes; mesh_i++) {
+            n_vertices += scene->mMeshes[mesh_i]->mNumVertices;
+            n_faces += scene->mMeshes[mesh_i]->mNumFaces;
+        }
+
         vertices.clear();
         faces.clear();
+        vertices.resize(n_vertices);
+        faces.reserve(n_faces);
 
+        // all meshes go into one vertex array, so face indices are shifted by the vertices before them
+        unsigned offset = 0;
         for (int mesh_i = 0; mesh_i < scene->mNumMeshes; mesh_i++) {
             aiMesh *ai_mesh = scene->mMeshes[mesh_i];
 
             for (int vertex_i = 0; vertex_i < ai_mesh->mNumVertices; vertex_i++) {
                 aiVector3D vertex = ai_mesh->mVertices[vertex_i];
-                vertices.push_back(glm::vec3(vertex.x, vertex.y, vertex.z));
+                vertices[offset + vertex_i] = glm::vec3(vertex.x, vertex.y, vertex.z);
             }
 
             for (int face_i = 0; face_i < ai_mesh->mNumFaces; face_i++) {
-                aiFace face = ai_mesh->mFaces[face_i];
-                for (int index_i = 0; index_i < face.mNumIndices; index_i++) {
-                    faces.push_back({face.mIndices[0], face.mIndices[1], face.mIndices[2]});
+                const aiFace& face = ai_mesh->mFaces[face_i];
+                if (face.mNumIndices != 3) { // points and lines are left by triangulation
+                    continue;
                 }
+                faces.push_back({offset + face.mIndices[0], offset + face.mIndices[1], offset + face.mIndices[2]});
             }
+
+            offset += ai_mesh->mNumVertices;
         }
     }
 };
@@ -77,15 +100,162 @@ struct Mesh {
 std::tuple<bool, float, float> // mask, t_enter, t_exit
 ray_box_intersection(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &min, const glm::vec3 &max);
 
+std::tuple<bool, float, float, float> // mask, t, u, v
+ray_triangle_intersection(const glm::vec3 &o, const glm::vec3 &d, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2);
+
+// clips triangle (v0, v1, v2) to the box, writes the remaining convex polygon to out and returns its vertex count
+int clip_triangle(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &min, const glm::vec3 &max, glm::vec3 out[9]);
+
+// closest point of triangle (v0, v1, v2) to p as v0 + u (v1 - v0) + v (v2 - v0)
+std::tuple<float, float> // u, v
+closest_point_triangle(const glm::vec3& p, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2);
+
+// interleaved code of a point in [0, 1]^3 with `bits` = 30 or 63
+uint64_t morton_code(const glm::vec3& p, int bits);
+
+
+enum class BuildMethod {
+    Sweep,      // sort faces by min coordinate along the longest axis and sweep all split positions
+    BinnedSAH,  // bin face centroids and pick the cheapest bin boundary by surface area heuristic
+    LBVH,       // sort face centroids along a Morton curve and split where codes differ, much faster, lower quality
+    SBVH,       // binned SAH that may also split space, faces crossing the plane go to both sides; slow, for long thin faces
+};
+
+
+enum class NodeLayout {
+    Flat,         // 32-byte nodes with exact bounds
+    Quantized8,   // 24-byte nodes with 8-bit child bounds relative to the node
+    Quantized16,  // 16-byte nodes with 16-bit bounds relative to the root
+    Wide4,        // binary tree collapsed into 4-wide nodes, tested with one SIMD slab test; leaves come in another order
+    Wide8,        // same with 8-wide nodes
+};
+
+
+enum class Projection {
+    Pinhole,       // rays start at the camera origin and spread through the image plane
+    Orthographic,  // parallel rays starting on the image plane
+};
+
+
+// Pixel (x, y) of a width x height image is at u, v in [-1, 1], v = 1 in the top row. Pinhole rays
+// start at origin with direction forward + u * right + v * up, orthographic rays start at
+// origin + u * right + v * up with direction forward. Directions are not normalized.
+struct Camera {
+    glm::vec3 origin, forward, right, up;
+    Projection projection = Projection::Pinhole;
+};
+
+
+enum class RenderMode {
+    FirstLeaf,   // the first leaf intersect_leaves returns: mask, leaf index, t_enter, t_exit
+    ClosestHit,  // the nearest triangle: mask, face index, t in t_enter
+};
+
+
+// per-pixel outputs of BVH::render, width x height row-major images; null ones are not written
+struct RenderTarget {
+    bool *mask = nullptr;
+    int *id = nullptr;
+    float *t_enter = nullptr;
+    float *t_exit = nullptr;
+};
+
+
+// per-ray outputs of BVH::intersect_leaves_packets, arrays of n rays
+struct LeafTarget {
+    bool *mask;
+    int *leaf;
+    float *t_enter;
+    float *t_exit;
+};
+
+
+// per-ray outputs of BVH::closest_hit_packets and any_hit_packets, arrays of n rays; barycentrics
+// holds u, v of every ray and is not written if null
+struct HitTarget {
+    bool *mask;
+    int *face;
+    float *t;
+    float *barycentrics = nullptr;
+};
+
+
+struct BuildParams {
+    BuildMethod method = BuildMethod::BinnedSAH;
+    int depth = 15;
+    int n_bins = 32;        // BinnedSAH and SBVH
+    int max_leaf_size = 8;  // BinnedSAH, LBVH and SBVH, larger leaves are split even if SAH disagrees
+    int n_threads = 0;      // BinnedSAH and LBVH, 0 means all hardware threads
+    int morton_bits = 0;    // LBVH only, 30 or 63, 0 picks 63 for meshes over 2^20 faces
+    bool refine = false;    // LBVH only, restructure treelets by SAH after the build
+    float duplication_budget = 0.3f; // SBVH only, extra face references allowed, as a fraction of the face count
+    bool leaf_triangles = false; // copy triangles into TriangleBlocks in leaf order for closest_hit and any_hit
+    NodeLayout layout = NodeLayout::Flat;
+};
+
+
+// per-face bounds computed once before the build, so that builders don't gather vertices repeatedly
+struct FaceBounds {
+    glm::vec3 min, max, centroid;
+};
+
+
+// Work done by one query, filled by the query overloads taking TraversalStats. The plain
+// overloads use NoStats instead, so the counting is compiled out of them entirely.
+struct TraversalStats {
+    int nodes_visited = 0;  // nodes taken from the stack, leaves included
+    int box_tests = 0;      // ray-box or point-box tests
+    int leaves_tested = 0;
+    int triangle_tests = 0;
+    int max_stack = 0;      // stack (or heap) high-water mark
+
+    void visit_node() { nodes_visited++; }
+    void test_boxes(int n) { box_tests += n; }
+    void test_leaf() { leaves_tested++; }
+    void test_triangle() { triangle_tests++; }
+    void stack(int size) { max_stack = std::max(max_stack, size); }
+};
+
+struct NoStats {
+    void visit_node() {}
+    void test_boxes(int) {}
+    void test_leaf() {}
+    void test_triangle() {}
+    void stack(int) {}
+};
+
+
+// tree quality measures, see BVH::tree_stats
+struct TreeStats {
+    float sah_cost;
+    float overlap;                   // sum of the surface areas of sibling box intersections, relative to the root
+    float epo = 0;                   // end-point overlap: SAH-weighted area of faces inside nodes they don't belong to, if computed
+    std::vector<int> leaf_sizes;     // number of leaves by face count
+    std::vector<int> leaf_depths;    // number of leaves by depth
+};
+
+
+struct LeafHit {
+    int leaf;
+    float t_enter, t_exit;
+    int instance = -1; // set by Scene queries only
+};
+
+
+class ThreadPool;
+class TaskGroup;
+
 
 struct BVHNode {
     glm::vec3 min, max;
     int left, right;
-    std::vector<Face> faces;
+    int first, count; // faces of the subtree are prim_indices[first, first + count)
 
     BVHNode() {
         left = -1;
         right = -1;
+        first = 0;
+        count = 0;
         min = glm::vec3(FLT_MAX);
         max = glm::vec3(-FLT_MAX);
     }
@@ -102,11 +272,131 @@ struct BVHNode {
 };
 
 
+const uint32_t INNER_NODE = 0xffffffffu; // FlatNode::count of inner nodes, leaves may be empty
+
+
+// Traversal node. Nodes are stored in depth-first order, so the left child
+// of an inner node is always the next node and only the right one is stored.
+struct alignas(32) FlatNode {
+    glm::vec3 min;
+    uint32_t offset; // right child for inner nodes, first index in prim_indices for leaves
+    glm::vec3 max;
+    uint32_t count;  // number of faces for leaves, INNER_NODE for inner nodes
+
+    bool is_leaf() const {
+        return count != INNER_NODE;
+    }
+};
+
+
+// 65536 cells per axis over the root box that quantized nodes are stored on. Cell sizes are
+// powers of two, so a coordinate decodes exactly to origin + q * cell.
+struct QuantizationGrid {
+    glm::vec3 origin;
+    glm::vec3 cell;
+};
+
+
+// Traversal node with both child boxes stored on an 8-bit grid over this node's box. The grid
+// starts on the root grid and its cells are the root cells times 2^scale per axis, boxes are
+// rounded outwards. Leaves store their own box as child 0.
+struct alignas(8) QuantizedNode8 {
+    uint16_t origin[3];        // on the root grid
+    uint16_t scale;            // 4 bits per axis
+    uint8_t child_min[2][3];
+    uint8_t child_max[2][3];
+    uint32_t right;            // 0 for leaves, the root is nobody's child
+
+    bool is_leaf() const {
+        return right == 0;
+    }
+};
+
+
+// Traversal node with its own box on the root grid, rounded outwards.
+struct alignas(16) QuantizedNode16 {
+    uint16_t min[3];
+    uint16_t max[3];
+    uint32_t right;            // 0 for leaves
+
+    bool is_leaf() const {
+        return right == 0;
+    }
+};
+
+
+const int TRIANGLE_BLOCK_SIZE = 4;
+
+
+// Up to TRIANGLE_BLOCK_SIZE triangles of one leaf as vertex and edges in SoA layout, so that
+// they are tested at once without gathering vertices. Unused lanes have zero edges and never hit.
+struct alignas(16) TriangleBlock {
+    float v0[3][TRIANGLE_BLOCK_SIZE];
+    float e1[3][TRIANGLE_BLOCK_SIZE];
+    float e2[3][TRIANGLE_BLOCK_SIZE];
+    uint32_t face[TRIANGLE_BLOCK_SIZE]; // index into mesh.faces
+};
+
+
+const uint32_t WIDE_LEAF = 0x80000000u; // WideNode::child refers to a leaf, by its index in flat_nodes and nodes alike
+const uint32_t TRAVERSAL_DONE = 0xffffffffu; // token of a stackless traversal that returned all its leaves
+
+
+// Node of a collapsed wide tree. Child boxes are stored per axis, so that one ray is
+// tested against all children at once. Leaves of the binary tree are kept as they are.
+template <int W>
+struct alignas(32) WideNode {
+    float min_x[W], min_y[W], min_z[W];
+    float max_x[W], max_y[W], max_z[W];
+    uint32_t child[W];   // index of a wide node, or index of a leaf in nodes with WIDE_LEAF set
+    uint32_t n_children;
+};
+
+
+// shared state of one binned SAH build
+struct BinnedBuild {
+    std::vector<FaceBounds> bounds;
+    unsigned *indices;             // BVH::prim_indices, partitioned in place
+
+    ThreadPool *pool = nullptr;    // null for single-threaded builds
+    TaskGroup *group = nullptr;
+    int task_size = 0;             // subtrees smaller than this are grown as separate tasks
+
+    struct Task {
+        int node;                  // root of the subtree in BVH::nodes
+        std::vector<BVHNode> nodes;
+    };
+    std::deque<Task> tasks;        // deque keeps tasks in place while new ones are added
+};
+
+
 struct BVH {
-    int max_depth = 15;
+    int max_depth = 15; // depth() of the built tree, may exceed build_params.depth after treelet restructuring
 
     Mesh mesh;
     std::vector<BVHNode> nodes;
+    Buffer<unsigned> prim_indices; // face indices, every node owns a contiguous range
+    BuildParams build_params;
+
+    // traversal copies of nodes: flat_nodes is always filled, the others only for their layout.
+    // Trees loaded from a file keep only flat_nodes, nodes are restored by finalize if needed.
+    Buffer<FlatNode> flat_nodes;
+    std::vector<QuantizedNode8> quantized8_nodes;
+    std::vector<QuantizedNode16> quantized16_nodes;
+    QuantizationGrid quantization_grid; // of the quantized layouts
+    std::vector<WideNode<4>> wide4_nodes;
+    std::vector<WideNode<8>> wide8_nodes;
+
+    // BuildParams::leaf_triangles only: blocks of every leaf in depth-first order, the first
+    // block of a leaf by its flat node index. Refilled by fill_layout, not stored in files.
+    std::vector<TriangleBlock> triangle_blocks;
+    std::vector<uint32_t> leaf_blocks;
+
+    int required_stack_size = 0; // stack entries intersect_leaves may need with the current layout
+    std::vector<uint32_t> parents; // parent of every flat node, the root's is 0
+
+    float build_sah = 0;            // sah_cost() after the build, 0 for loaded trees until the first refit
+    std::vector<float> build_costs; // SAH cost of every subtree relative to its box, set by the first refit
 
     BVH() {}
 
@@ -115,47 +405,201 @@ struct BVH {
     }
 
     void build_bvh(int depth); // inits root and grows bvh
+    void build_bvh(const BuildParams& params);
+    void build_bvh_binned(const BuildParams& params);
+    void build_binned_over(ThreadPool& pool, const BuildParams& params, std::vector<FaceBounds> bounds); // grows nodes[0]
+
+    // binned SAH build over arbitrary boxes instead of mesh faces, prim_indices refer to `bounds`
+    void build_over_bounds(std::vector<FaceBounds> bounds, const BuildParams& params);
+    void build_bvh_lbvh(const BuildParams& params);
+    void build_bvh_sbvh(const BuildParams& params);
+    void compute_face_bounds(ThreadPool& pool, std::vector<FaceBounds>& bounds);
     void grow_bvh(int node, int depth); // recursive function to grow bvh
+    void grow_bvh_binned(std::vector<BVHNode>& out, int node, int depth, BinnedBuild& build, int first, int count);
+    void splice_subtree(int node, std::vector<BVHNode>& subtree); // replaces children of node with a separately grown subtree
     
     std::tuple<glm::vec3, glm::vec3>
     get_bbox(int node){
-        return {nodes[node].min, nodes[node].max};
+        return {flat_nodes[node].min, flat_nodes[node].max};
     }
 
+    std::vector<Face> get_leaf_faces(int node);
+
+    // sorts nodes depth-first and fills the traversal nodes for the given layout, called by build_bvh
+    void finalize(NodeLayout layout);
+    void finalize_flat();
+    void fill_layout();
+    void fill_triangle_blocks();
+    void restore_nodes(); // rebuilds nodes of a loaded tree from flat_nodes
+    void fill_parents();
+
+    // Replaces every treelet of up to treelet_size (at most 8) leaves with its SAH-optimal
+    // topology, bottom-up. Leaves stay as they are, inner node bounds are recomputed.
+    // Returns the SAH cost of nodes, flat_nodes are only updated by finalize.
+    float restructure_treelets(ThreadPool& pool, int treelet_size);
+
+    // Restructures treelets of the built tree, whatever the builder, in passes until one improves
+    // SAH by less than 0.1% or max_iterations passes ran. time_budget > 0 limits the seconds
+    // spent. The result becomes the reference for sah_growth(). Returns SAH before, after and
+    // the number of passes.
+    std::tuple<float, float, int> optimize(int max_iterations = 8, double time_budget = 0);
+
     int depth() {
         return depth(0);
     }
     int depth(int node) {
-        if (nodes[node].is_leaf()) {
+        if (flat_nodes[node].is_leaf()) {
             return 0;
         }
-        return 1 + std::max(depth(nodes[node].left), depth(nodes[node].right));
+        return 1 + std::max(depth(node + 1), depth(flat_nodes[node].offset));
     }
 
     int n_nodes() {
-        return nodes.size();
+        return flat_nodes.size();
     }
 
     int n_leaves() {
         return n_leaves(0);
     }
     int n_leaves(int node) {
-        if (nodes[node].is_leaf()) {
+        if (flat_nodes[node].is_leaf()) {
             return 1;
         }
-        int n = 0;
-        if (nodes[node].left  != -1) n += n_leaves(nodes[node].left);
-        if (nodes[node].right != -1) n += n_leaves(nodes[node].right);
-        return n;
+        return n_leaves(node + 1) + n_leaves(flat_nodes[node].offset);
+    }
+
+    // surface area heuristic cost of the whole tree, relative to the root box
+    float sah_cost();
+
+    // Moves the mesh to new vertex positions and recomputes all bounds, the topology stays.
+    // With rebuild_fraction > 0 the subtrees that degraded most, up to that fraction of
+    // faces, are grown again by binned SAH. Returns sah_growth().
+    float refit(Buffer<glm::vec3> vertices, float rebuild_fraction = 0);
+    void refit_subtree(ThreadPool& pool, std::vector<float>& cost, int node, int end);
+    void rebuild_worst_subtrees(ThreadPool& pool, const std::vector<float>& cost, float rebuild_fraction);
+
+    // sah_cost() relative to the tree right after the build, rebuild once this grows too much
+    float sah_growth() {
+        return build_sah > 0 ? sah_cost() / build_sah : 1;
     }
 
     // save leaves as boxes in .obj file
     void save_as_obj(const std::string& filename);
+
+    // Binary dump of the mesh, flat nodes and build parameters. load maps the file and
+    // reads it in place, so processes loading the same file share its pages. Every index in
+    // the file is checked once by load, which throws on a corrupted file.
+    void save(const std::string& path);
+    void load(const std::string& path);
     
+    // Leaves come in depth-first order, the child entered first at every binary node before the
+    // other. Wide layouts order all children of a wide node by t_enter instead, so they return
+    // the same leaves in a different order than Flat and the quantized layouts.
+    // With a quantized layout leaves are tested against their quantized boxes, which are slightly
+    // larger than the exact ones: a ray may get a few more leaves, and t_enter/t_exit of the larger box.
     std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
     intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack); // bvh traversal, stack_size and stack are altered
+
+    template <typename Stats>
+    std::tuple<bool, int, float, float>
+    intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats);
+
+    // intersect_leaves without a stack: the state of a ray is one token, 0 before the first call
+    // and TRAVERSAL_DONE after the last leaf. Leaves come in the order of the Flat layout. The traversal goes
+    // back up through parent links, testing both children of every node it passes again, and
+    // always runs on flat_nodes whatever the layout.
+    std::tuple<bool, int, float, float> // mask, leaf index, t_enter, t_exit
+    intersect_leaves_stackless(const glm::vec3& o, const glm::vec3& d, uint32_t& token);
+
+    template <typename Stats>
+    std::tuple<bool, int, float, float>
+    intersect_leaves_stackless(const glm::vec3& o, const glm::vec3& d, uint32_t& token, Stats& stats);
+
+    // appends every leaf the ray hits to `hits`, ordered by t_enter; if max_hits > 0 only the nearest max_hits leaves
+    void intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits);
+
+    template <typename Stats>
+    void intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits, Stats& stats);
+
+    // nearest triangle hit with t in [t_min, t_max], the interval shrinks as hits are found
+    std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+    closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min = 0, float t_max = FLT_MAX);
+
+    std::tuple<bool, int, float, float, float>
+    closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, TraversalStats& stats);
+
+    // first triangle hit found with t in [t_min, t_max], for occlusion tests
+    std::tuple<bool, int, float, float, float> // mask, face index, t, u, v
+    any_hit(const glm::vec3& o, const glm::vec3& d, float t_min = 0, float t_max = FLT_MAX);
+
+    std::tuple<bool, int, float, float, float>
+    any_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, TraversalStats& stats);
+
+    // Batches of n rays traced in packets of the SIMD width, 4, 8 or 16 rays that share one stack,
+    // for coherent rays such as neighbouring camera rays. intersect_leaves_packets gives the results
+    // and stacks of intersect_leaves. Rays resuming from their stack, rays that would enter two
+    // children in the other order than most of their packet, and layouts other than Flat are traced
+    // one at a time. The stack of ray i is at stack + i * stack_stride.
+    void intersect_leaves_packets(int n, const glm::vec3* o, const glm::vec3* d, int* stack_size, uint32_t* stack, int stack_stride,
+                                  const LeafTarget& out);
+
+    // closest_hit and any_hit in packets, on flat_nodes as the single-ray queries; hits agree with
+    // them up to rounding, and any_hit may return another of the hits
+    void closest_hit_packets(int n, const glm::vec3* o, const glm::vec3* d, float t_min, float t_max, const HitTarget& out);
+    void any_hit_packets(int n, const glm::vec3* o, const glm::vec3* d, float t_min, float t_max, const HitTarget& out);
+
+    // nearest point of the mesh within max_distance of p, u and v are barycentrics of it on the face;
+    // nothing is found for a negative or NaN max_distance
+    std::tuple<bool, int, float, glm::vec3, float, float> // mask, face index, distance, closest point, u, v
+    closest_point(const glm::vec3& p, float max_distance = FLT_MAX);
+
+    template <typename Stats>
+    std::tuple<bool, int, float, glm::vec3, float, float>
+    closest_point(const glm::vec3& p, float max_distance, Stats& stats);
+
+    template <bool AnyHit, typename Stats>
+    std::tuple<bool, int, float, float, float>
+    intersect_triangles(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, Stats& stats);
+
+    template <typename Node, typename Stats>
+    std::tuple<bool, int, float, float>
+    intersect_leaves_quantized(const std::vector<Node>& qnodes, const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats);
+
+    template <int W, typename Stats>
+    std::tuple<bool, int, float, float>
+    intersect_leaves_wide(const std::vector<WideNode<W>>& wnodes, const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack, Stats& stats);
+
+    // Traces one ray per pixel, generated from the camera on the fly, in square screen tiles taken
+    // in Morton order by n_threads threads (0 means all).
+    void render(const Camera& camera, int width, int height, RenderMode mode, const RenderTarget& target, int n_threads = 0);
+
+    // Faces overlapping a box or a sphere are appended to `ids`, each once. Faces are tested
+    // exactly. With leaves set, the flat node indices of leaves whose boxes overlap are appended instead.
+    void query_aabb(const glm::vec3& min, const glm::vec3& max, bool leaves, std::vector<int>& ids);
+    void query_sphere(const glm::vec3& center, float radius, bool leaves, std::vector<int>& ids);
+
+    // Batches of n queries on n_threads threads (0 means all), results in CSR form: the ids of
+    // query i are ids[offsets[i], offsets[i + 1]). sort_queries runs queries in Morton order of
+    // their centers, so that neighbouring ones share nodes in cache; results keep the input order.
+    void query_aabbs(int n, const glm::vec3* mins, const glm::vec3* maxs, bool leaves, bool sort_queries, int n_threads,
+                     std::vector<int64_t>& offsets, std::vector<int>& ids);
+    void query_spheres(int n, const glm::vec3* centers, const float* radii, bool leaves, bool sort_queries, int n_threads,
+                       std::vector<int64_t>& offsets, std::vector<int>& ids);
+
+    // SAH cost, leaf size and depth histograms and sibling overlap of the built tree, EPO only
+    // with with_epo set: it clips faces against every box they overlap, which takes much longer than a build
+    TreeStats tree_stats(bool with_epo = false);
 };
 
 
+float box_area(const glm::vec3& min, const glm::vec3& max);
 float leaf_cost(const BVHNode& node);
-float split_cost(const BVH& bvh, int node, int axis, const std::vector<Face>& faces_sorted, int split_i);
\ No newline at end of file
+float split_cost(const BVH& bvh, int node, int axis, int split_i); // faces of node are sorted in bvh.prim_indices
+
+
+// closed boxes, so touching ones overlap
+inline bool boxes_overlap(const glm::vec3& min_a, const glm::vec3& max_a, const glm::vec3& min_b, const glm::vec3& max_b) {
+    return min_a.x <= max_b.x && min_b.x <= max_a.x
+        && min_a.y <= max_b.y && min_b.y <= max_a.y
+        && min_a.z <= max_b.z && min_b.z <= max_a.z;
+}
\ No newline at end of file
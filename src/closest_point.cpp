@@ -0,0 +1,158 @@
+// Closest point queries. Nodes are visited best-first by the squared distance from the
+// query point to their box, which is a lower bound for every face below them, so the
+// search ends as soon as the nearest unvisited box is farther than the best face found.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bvh.h"
+
+
+static float box_distance2(const glm::vec3& p, const glm::vec3& min, const glm::vec3& max) {
+    glm::vec3 d = glm::max(glm::max(min - p, p - max), glm::vec3(0));
+    return glm::dot(d, d);
+}
+
+
+// closest point of triangle (v0, v1, v2) to p as v0 + u (v1 - v0) + v (v2 - v0), by the
+// Voronoi regions of vertices and edges (Ericson, Real-Time Collision Detection 5.1.5);
+// zero length edges are skipped, so that degenerate faces fall back to their other edges.
+// Computed in double: va, vb and vc are differences of products of edge dot products, which
+// cancel in float for long thin faces and put the point far off the face.
+std::tuple<float, float> // u, v
+closest_point_triangle(const glm::vec3& p, const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2) {
+    glm::dvec3 e1 = glm::dvec3(v1) - glm::dvec3(v0);
+    glm::dvec3 e2 = glm::dvec3(v2) - glm::dvec3(v0);
+
+    glm::dvec3 p0 = glm::dvec3(p) - glm::dvec3(v0);
+    double d1 = glm::dot(e1, p0);
+    double d2 = glm::dot(e2, p0);
+    if (d1 <= 0 && d2 <= 0) {
+        return {0, 0};
+    }
+
+    glm::dvec3 p1 = glm::dvec3(p) - glm::dvec3(v1);
+    double d3 = glm::dot(e1, p1);
+    double d4 = glm::dot(e2, p1);
+    if (d3 >= 0 && d4 <= d3) {
+        return {1, 0};
+    }
+
+    double vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0 && d1 - d3 > 0) {
+        return {d1 / (d1 - d3), 0};
+    }
+
+    glm::dvec3 p2 = glm::dvec3(p) - glm::dvec3(v2);
+    double d5 = glm::dot(e1, p2);
+    double d6 = glm::dot(e2, p2);
+    if (d6 >= 0 && d5 <= d6) {
+        return {0, 1};
+    }
+
+    double vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0 && d2 - d6 > 0) {
+        return {0, d2 / (d2 - d6)};
+    }
+
+    double va = d3 * d6 - d5 * d4;
+    if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0 && (d4 - d3) + (d5 - d6) > 0) {
+        double w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        return {1 - w, w};
+    }
+
+    double denom = va + vb + vc;
+    if (denom <= 0) {
+        return {0, 0};
+    }
+    return {vb / denom, vc / denom};
+}
+
+
+std::tuple<bool, int, float, glm::vec3, float, float> // mask, face index, distance, closest point, u, v
+BVH::closest_point(const glm::vec3& p, float max_distance) {
+    NoStats stats;
+    return closest_point(p, max_distance, stats);
+}
+
+
+template <typename Stats>
+std::tuple<bool, int, float, glm::vec3, float, float> // mask, face index, distance, closest point, u, v
+BVH::closest_point(const glm::vec3& p, float max_distance, Stats& stats) {
+    bool found = false;
+    int face = -1;
+    float best2 = max_distance < FLT_MAX ? max_distance * max_distance : FLT_MAX;
+    glm::vec3 point(0);
+    float u_best = 0, v_best = 0;
+    if (!(max_distance >= 0)) {
+        return {false, -1, max_distance, point, 0, 0};
+    }
+
+    stats.test_boxes(1);
+    float root2 = box_distance2(p, flat_nodes[0].min, flat_nodes[0].max);
+    if (root2 > best2) {
+        return {false, -1, max_distance, point, 0, 0};
+    }
+
+    // min-heap of (squared box distance, node)
+    auto farther = [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+        return a.first > b.first;
+    };
+    std::vector<std::pair<float, uint32_t>> heap;
+    heap.reserve(2 * required_stack_size);
+    heap.push_back({root2, 0});
+
+    while (!heap.empty() && heap.front().first <= best2) {
+        std::pop_heap(heap.begin(), heap.end(), farther);
+        uint32_t node_idx = heap.back().second;
+        heap.pop_back();
+        const FlatNode& node = flat_nodes[node_idx];
+        stats.visit_node();
+
+        if (node.is_leaf()) {
+            stats.test_leaf();
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                stats.test_triangle();
+                const Face& f = mesh.faces[prim_indices[i]];
+                const glm::vec3& v0 = mesh.vertices[f.v1];
+                const glm::vec3& v1 = mesh.vertices[f.v2];
+                const glm::vec3& v2 = mesh.vertices[f.v3];
+                auto [u, v] = closest_point_triangle(p, v0, v1, v2);
+                glm::vec3 q = v0 + u * (v1 - v0) + v * (v2 - v0);
+                float dist2 = glm::dot(q - p, q - p);
+                if (!(dist2 < best2 || (!found && dist2 == best2))) {
+                    continue;
+                }
+
+                found = true;
+                face = prim_indices[i];
+                best2 = dist2;
+                point = q;
+                u_best = u;
+                v_best = v;
+            }
+            continue;
+        }
+
+        stats.test_boxes(2);
+        for (uint32_t child : {node_idx + 1, node.offset}) {
+            float dist2 = box_distance2(p, flat_nodes[child].min, flat_nodes[child].max);
+            if (dist2 <= best2) {
+                heap.push_back({dist2, child});
+                std::push_heap(heap.begin(), heap.end(), farther);
+            }
+        }
+        stats.stack(heap.size());
+    }
+
+    if (!found) {
+        return {false, -1, max_distance, point, 0, 0};
+    }
+    return {true, face, std::sqrt(best2), point, u_best, v_best};
+}
+
+
+template std::tuple<bool, int, float, glm::vec3, float, float> BVH::closest_point(const glm::vec3&, float, TraversalStats&);
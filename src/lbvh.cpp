@@ -0,0 +1,283 @@
+// Linear BVH: faces are sorted along a Morton curve over their centroids and the hierarchy
+// is read off the sorted codes, every inner node is found independently of the others.
+// Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int LBVH_TREELET_SIZE = 5;  // treelet leaves of the refine pass, cost grows as 3^n per node
+const int RADIX_BITS = 11;        // 3 passes for 30-bit codes, 6 for 63-bit ones
+const int RADIX_SIZE = 1 << RADIX_BITS;
+
+
+// spreads the low 10 bits of v, leaving two zero bits between each of them
+static uint32_t expand_bits_10(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x030000ff;
+    v = (v | v << 8) & 0x0300f00f;
+    v = (v | v << 4) & 0x030c30c3;
+    v = (v | v << 2) & 0x09249249;
+    return v;
+}
+
+// same for the low 21 bits
+static uint64_t expand_bits_21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x001f00000000ffffull;
+    v = (v | v << 16) & 0x001f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// interleaved code of a point in [0, 1]^3 with `bits` = 30 or 63
+uint64_t morton_code(const glm::vec3& p, int bits) {
+    float cells = bits == 30 ? 1024.0f : 2097152.0f;
+    glm::vec3 q = glm::clamp(p * cells, glm::vec3(0.0f), glm::vec3(cells - 1));
+    if (bits == 30) {
+        return expand_bits_10((uint32_t) q.x) << 2 | expand_bits_10((uint32_t) q.y) << 1 | expand_bits_10((uint32_t) q.z);
+    }
+    return expand_bits_21((uint64_t) q.x) << 2 | expand_bits_21((uint64_t) q.y) << 1 | expand_bits_21((uint64_t) q.z);
+}
+
+
+// LSD radix sort of keys with values, RADIX_BITS per pass. Every chunk of PARALLEL_GRAIN items
+// counts its digits, the counts are turned into per-chunk offsets and chunks scatter in parallel.
+static void radix_sort(ThreadPool& pool, std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int bits) {
+    int n = keys.size();
+    int n_chunks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    std::vector<uint64_t> keys_tmp(n);
+    std::vector<uint32_t> values_tmp(n);
+    std::vector<std::array<int, RADIX_SIZE>> offsets(n_chunks);
+
+    for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+        for (std::array<int, RADIX_SIZE>& chunk : offsets) {
+            chunk.fill(0);
+        }
+        pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+            std::array<int, RADIX_SIZE>& counts = offsets[begin / PARALLEL_GRAIN];
+            for (int i = begin; i < end; i++) {
+                counts[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+            }
+        });
+
+        int sum = 0;
+        bool sorted = false; // all keys have the same digit, nothing moves
+        for (int digit = 0; digit < RADIX_SIZE; digit++) {
+            int digit_start = sum;
+            for (std::array<int, RADIX_SIZE>& counts : offsets) {
+                int count = counts[digit];
+                counts[digit] = sum;
+                sum += count;
+            }
+            sorted |= sum - digit_start == n;
+        }
+        if (sorted) {
+            continue;
+        }
+
+        pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+            std::array<int, RADIX_SIZE>& next = offsets[begin / PARALLEL_GRAIN];
+            for (int i = begin; i < end; i++) {
+                int j = next[(keys[i] >> shift) & (RADIX_SIZE - 1)]++;
+                keys_tmp[j] = keys[i];
+                values_tmp[j] = values[i];
+            }
+        });
+        keys.swap(keys_tmp);
+        values.swap(values_tmp);
+    }
+}
+
+
+void BVH::build_bvh_lbvh(const BuildParams& params) {
+    int n = mesh.faces.size();
+    if (n <= 1) {
+        // the root already is a leaf with all faces
+        for (int i = 0; i < n; i++) {
+            prim_indices[i] = i;
+        }
+        return;
+    }
+
+    ThreadPool& pool = shared_thread_pool(params.n_threads);
+
+    std::vector<FaceBounds> bounds;
+    compute_face_bounds(pool, bounds);
+
+    int n_chunks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+    std::vector<glm::vec3> chunk_min(n_chunks, glm::vec3(FLT_MAX));
+    std::vector<glm::vec3> chunk_max(n_chunks, glm::vec3(-FLT_MAX));
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        glm::vec3& min = chunk_min[begin / PARALLEL_GRAIN];
+        glm::vec3& max = chunk_max[begin / PARALLEL_GRAIN];
+        for (int i = begin; i < end; i++) {
+            min = glm::min(min, bounds[i].centroid);
+            max = glm::max(max, bounds[i].centroid);
+        }
+    });
+    glm::vec3 centroid_min(FLT_MAX), centroid_max(-FLT_MAX);
+    for (int i = 0; i < n_chunks; i++) {
+        centroid_min = glm::min(centroid_min, chunk_min[i]);
+        centroid_max = glm::max(centroid_max, chunk_max[i]);
+    }
+    glm::vec3 scale = 1.0f / glm::max(centroid_max - centroid_min, glm::vec3(FLT_MIN));
+
+    // 30-bit codes give 1024 cells per axis, too coarse to separate faces of large meshes
+    int bits = params.morton_bits;
+    if (bits != 30 && bits != 63) {
+        bits = n > (1 << 20) ? 63 : 30;
+    }
+
+    std::vector<uint64_t> codes(n);
+    std::vector<uint32_t> order(n);
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            codes[i] = morton_code((bounds[i].centroid - centroid_min) * scale, bits);
+            order[i] = i;
+        }
+    });
+    radix_sort(pool, codes, order, bits);
+
+    // length of the common prefix of sorted codes i and j, equal codes are told apart by index
+    auto delta = [&](int i, int j) {
+        if (j < 0 || j >= n) {
+            return -1;
+        }
+        uint64_t diff = codes[i] ^ codes[j];
+        return diff ? __builtin_clzll(diff) : 64 + __builtin_clz((uint32_t) (i ^ j));
+    };
+
+    // Inner node i covers a range of sorted faces starting or ending at face i and is split
+    // where the common prefix gets shorter. Children >= n - 1 are leaves, n - 1 + j holds face j.
+    std::vector<BVHNode> inner(n - 1);
+    std::vector<int> parent(2 * n - 1, -1);
+    pool.parallel_for(0, n - 1, PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+            int delta_min = delta(i, i - d);
+
+            int length_max = 2;
+            while (delta(i, i + length_max * d) > delta_min) {
+                length_max *= 2;
+            }
+            int length = 0;
+            for (int t = length_max / 2; t >= 1; t /= 2) {
+                if (delta(i, i + (length + t) * d) > delta_min) {
+                    length += t;
+                }
+            }
+            int j = i + length * d;
+
+            int delta_node = delta(i, j);
+            int split = 0;
+            for (int t = (length + 1) / 2; ; t = (t + 1) / 2) {
+                if (delta(i, i + (split + t) * d) > delta_node) {
+                    split += t;
+                }
+                if (t == 1) {
+                    break;
+                }
+            }
+            int gamma = i + split * d + std::min(d, 0);
+
+            BVHNode& node = inner[i];
+            node.first = std::min(i, j);
+            node.count = std::abs(j - i) + 1;
+            node.left = node.first == gamma ? n - 1 + gamma : gamma;
+            node.right = node.first + node.count - 1 == gamma + 1 ? n + gamma : gamma + 1;
+            parent[node.left] = i;
+            parent[node.right] = i;
+        }
+    });
+
+    // Bounds and SAH cost bottom-up: every leaf walks up and the second child to arrive
+    // at a node finishes it. Subtrees that are cheaper as one leaf are marked as such.
+    std::vector<float> cost(n - 1);
+    std::vector<uint8_t> make_leaf(n - 1);
+    std::vector<std::atomic<int>> arrived(n - 1);
+    auto child = [&](int c) {
+        if (c >= n - 1) {
+            const FaceBounds& b = bounds[order[c - (n - 1)]];
+            return std::make_tuple(b.min, b.max, box_area(b.min, b.max) * TRIANGLE_INTERSECTION_COST);
+        }
+        return std::make_tuple(inner[c].min, inner[c].max, cost[c]);
+    };
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int j = begin; j < end; j++) {
+            int p = parent[n - 1 + j];
+            while (p != -1 && arrived[p].fetch_add(1, std::memory_order_acq_rel) == 1) {
+                BVHNode& node = inner[p];
+                auto [min_l, max_l, cost_l] = child(node.left);
+                auto [min_r, max_r, cost_r] = child(node.right);
+                node.min = glm::min(min_l, min_r);
+                node.max = glm::max(max_l, max_r);
+
+                float area = box_area(node.min, node.max);
+                float split_cost = area * TRAVERSAL_COST + cost_l + cost_r;
+                float leaf_cost = area * node.count * TRIANGLE_INTERSECTION_COST;
+                make_leaf[p] = node.count <= params.max_leaf_size && leaf_cost <= split_cost;
+                cost[p] = make_leaf[p] ? leaf_cost : split_cost;
+
+                p = parent[p];
+            }
+        }
+    });
+
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            prim_indices[i] = order[i];
+        }
+    });
+
+    // final tree top-down, nodes at the depth limit become leaves like in the other builders
+    nodes.clear();
+    nodes.reserve(2 * (n / std::max(params.max_leaf_size, 1)) + 1);
+    nodes.emplace_back();
+    std::vector<std::tuple<int, int, int>> stack = {{0, 0, params.depth}}; // inner or leaf index, node, depth left
+    while (!stack.empty()) {
+        auto [src, out, depth] = stack.back();
+        stack.pop_back();
+
+        if (src >= n - 1) {
+            const FaceBounds& b = bounds[order[src - (n - 1)]];
+            nodes[out].min = b.min;
+            nodes[out].max = b.max;
+            nodes[out].first = src - (n - 1);
+            nodes[out].count = 1;
+            continue;
+        }
+
+        const BVHNode& node = inner[src];
+        nodes[out].min = node.min;
+        nodes[out].max = node.max;
+        nodes[out].first = node.first;
+        nodes[out].count = node.count;
+        if (depth <= 0 || make_leaf[src]) {
+            continue;
+        }
+
+        int left = nodes.size();
+        nodes.emplace_back();
+        nodes.emplace_back();
+        nodes[out].left = left;
+        nodes[out].right = left + 1;
+        stack.push_back({node.right, left + 1, depth - 1});
+        stack.push_back({node.left, left, depth - 1});
+    }
+
+    if (params.refine) {
+        restructure_treelets(pool, LBVH_TREELET_SIZE);
+    }
+}
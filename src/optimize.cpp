@@ -0,0 +1,204 @@
+// Post-build tree optimization by treelet restructuring, following Karras and Aila, "Fast
+// Parallel Construction of High-Quality Bounding Volume Hierarchies", 2013. Small treelets
+// are replaced with their SAH-optimal topology bottom-up; leaves are never changed, so this
+// works after any builder.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int MAX_TREELET_SIZE = 8;
+const int OPTIMIZE_TREELET_SIZE = 7;        // the paper's choice, 8 is about 3 times slower for little gain
+const float OPTIMIZE_MIN_IMPROVEMENT = 1e-3f; // optimize stops once a pass improves SAH by less than this fraction
+
+
+// leaves of the treelet rooted at `root`, unions of leaf subsets and their best partitions
+struct Treelet {
+    int n_leaves;
+    int leaves[MAX_TREELET_SIZE];
+    int inner[MAX_TREELET_SIZE - 1]; // inner[0] is the root
+    int n_inner;
+
+    glm::vec3 min[1 << MAX_TREELET_SIZE], max[1 << MAX_TREELET_SIZE];
+    float cost[1 << MAX_TREELET_SIZE];
+    int split[1 << MAX_TREELET_SIZE];
+};
+
+
+// rebuilds the inner nodes of subset `set` from the best partitions, returns the node
+static int emit_treelet(std::vector<BVHNode>& nodes, std::vector<float>& cost, Treelet& treelet, int set, int& next_inner) {
+    if ((set & (set - 1)) == 0) {
+        return treelet.leaves[__builtin_ctz(set)];
+    }
+
+    int node = treelet.inner[next_inner++];
+    int left = emit_treelet(nodes, cost, treelet, treelet.split[set], next_inner);
+    int right = emit_treelet(nodes, cost, treelet, set ^ treelet.split[set], next_inner);
+
+    nodes[node].left = left;
+    nodes[node].right = right;
+    nodes[node].min = treelet.min[set];
+    nodes[node].max = treelet.max[set];
+    nodes[node].count = nodes[left].count + nodes[right].count;
+    cost[node] = treelet.cost[set];
+    return node;
+}
+
+
+// cost[] of all nodes below the treelet leaves is known
+static void restructure_treelet(std::vector<BVHNode>& nodes, std::vector<float>& cost, int root, int treelet_size) {
+    Treelet treelet;
+    treelet.leaves[0] = nodes[root].left;
+    treelet.leaves[1] = nodes[root].right;
+    treelet.n_leaves = 2;
+    treelet.inner[0] = root;
+    treelet.n_inner = 1;
+
+    // grow the treelet by opening the largest leaf until it has enough leaves
+    while (treelet.n_leaves < treelet_size) {
+        int largest = -1;
+        float largest_area = -1;
+        for (int i = 0; i < treelet.n_leaves; i++) {
+            const BVHNode& leaf = nodes[treelet.leaves[i]];
+            float area = box_area(leaf.min, leaf.max);
+            if (!leaf.is_leaf() && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest == -1) {
+            break;
+        }
+
+        int opened = treelet.leaves[largest];
+        treelet.inner[treelet.n_inner++] = opened;
+        treelet.leaves[largest] = nodes[opened].left;
+        treelet.leaves[treelet.n_leaves++] = nodes[opened].right;
+    }
+    if (treelet.n_leaves < 3) {
+        return;
+    }
+
+    // every subset is split into two smaller ones, so increasing order visits parts first
+    int full = (1 << treelet.n_leaves) - 1;
+    for (int set = 1; set <= full; set++) {
+        int low = set & -set;
+        if (set == low) {
+            const BVHNode& leaf = nodes[treelet.leaves[__builtin_ctz(set)]];
+            treelet.min[set] = leaf.min;
+            treelet.max[set] = leaf.max;
+            treelet.cost[set] = cost[treelet.leaves[__builtin_ctz(set)]];
+            continue;
+        }
+
+        treelet.min[set] = glm::min(treelet.min[low], treelet.min[set ^ low]);
+        treelet.max[set] = glm::max(treelet.max[low], treelet.max[set ^ low]);
+
+        // only partitions holding the lowest leaf, the others are the same ones mirrored
+        float best = FLT_MAX;
+        for (int part = (set - 1) & set; part > 0; part = (part - 1) & set) {
+            if (!(part & low)) {
+                continue;
+            }
+            float part_cost = treelet.cost[part] + treelet.cost[set ^ part];
+            if (part_cost < best) {
+                best = part_cost;
+                treelet.split[set] = part;
+            }
+        }
+        treelet.cost[set] = box_area(treelet.min[set], treelet.max[set]) * TRAVERSAL_COST + best;
+    }
+
+    if (treelet.cost[full] < cost[root]) {
+        int next_inner = 0;
+        emit_treelet(nodes, cost, treelet, full, next_inner);
+    }
+}
+
+
+static void restructure_subtree(ThreadPool& pool, std::vector<BVHNode>& nodes, std::vector<float>& cost, int node, int treelet_size) {
+    const BVHNode& root = nodes[node];
+    float area = box_area(root.min, root.max);
+    if (root.is_leaf()) {
+        cost[node] = area * root.count * TRIANGLE_INTERSECTION_COST;
+        return;
+    }
+
+    int left = root.left;
+    int right = root.right;
+    if (pool.size() > 1 && root.count > PARALLEL_TASK_MIN_FACES) {
+        TaskGroup group(pool);
+        group.run([&, left]() {
+            restructure_subtree(pool, nodes, cost, left, treelet_size);
+        });
+        restructure_subtree(pool, nodes, cost, right, treelet_size);
+        group.wait();
+    } else {
+        restructure_subtree(pool, nodes, cost, left, treelet_size);
+        restructure_subtree(pool, nodes, cost, right, treelet_size);
+    }
+
+    cost[node] = area * TRAVERSAL_COST + cost[left] + cost[right];
+    restructure_treelet(nodes, cost, node, treelet_size);
+}
+
+
+float BVH::restructure_treelets(ThreadPool& pool, int treelet_size) {
+    treelet_size = std::min(treelet_size, MAX_TREELET_SIZE);
+    std::vector<float> cost(nodes.size());
+    restructure_subtree(pool, nodes, cost, 0, treelet_size);
+    return cost[0] / box_area(nodes[0].min, nodes[0].max);
+}
+
+
+std::tuple<float, float, int> BVH::optimize(int max_iterations, double time_budget) {
+    if (flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+    if (nodes.empty()) {
+        restore_nodes();
+    }
+
+    auto now = []() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+    double start = now();
+
+    ThreadPool& pool = shared_thread_pool(build_params.n_threads);
+    float before = sah_cost();
+    float sah = before;
+    int iterations = 0;
+    double last_pass = 0;
+    while (iterations < max_iterations) {
+        // don't start a pass that would likely end past the budget
+        double elapsed = now() - start;
+        if (time_budget > 0 && elapsed + last_pass > time_budget) {
+            break;
+        }
+
+        float new_sah = restructure_treelets(pool, OPTIMIZE_TREELET_SIZE);
+        iterations++;
+        last_pass = now() - start - elapsed;
+
+        bool converged = sah - new_sah < OPTIMIZE_MIN_IMPROVEMENT * sah;
+        sah = new_sah;
+        if (converged) {
+            break;
+        }
+    }
+
+    if (iterations > 0) {
+        finalize(build_params.layout);
+        build_sah = sah_cost();
+        build_costs.clear();
+    }
+    return {before, sah_cost(), iterations};
+}
@@ -0,0 +1,364 @@
+// Packet traversal: rays that start together at the root, such as neighbouring camera rays, are
+// traced SIMD_WIDTH at a time. A packet shares one stack whose entries carry a bit for every ray
+// that hit the node, so each box is tested against all rays of the packet at once and a ray only
+// follows the entries with its bit. Children are pushed in the order most rays agree on.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include "bvh.h"
+#include "simd.h"
+
+
+// rays of a packet in SoA layout, lanes past n repeat the first ray so that they compute nothing undefined
+template <int W>
+struct RayPacket {
+    vfloat<W> o[3], d[3], inv_d[3];
+
+    RayPacket(const glm::vec3* origins, const glm::vec3* directions, int n) {
+        alignas(64) float values[6][W];
+        for (int lane = 0; lane < W; lane++) {
+            int i = lane < n ? lane : 0;
+            for (int axis = 0; axis < 3; axis++) {
+                values[axis][lane] = origins[i][axis];
+                values[3 + axis][lane] = directions[i][axis];
+            }
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            o[axis] = vfloat<W>::load(values[axis]);
+            d[axis] = vfloat<W>::load(values[3 + axis]);
+            inv_d[axis] = vfloat<W>::broadcast(1.0f) / d[axis];
+        }
+    }
+
+    // bit-identical to ray_box_intersection, intersect_leaves returns t_enter and t_exit and orders children by them
+    uint32_t test_box(const FlatNode& node, vfloat<W>& t_enter, vfloat<W>& t_exit) const {
+        return ray_box_intersection<W>(o, d, &node.min.x, &node.max.x, t_enter, t_exit);
+    }
+
+    // closest_hit and any_hit only cull by the box distances, which don't need the last bit
+    uint32_t test_box_rcp(const FlatNode& node, vfloat<W>& t_enter, vfloat<W>& t_exit) const {
+        return ray_box_intersection_rcp<W>(o, inv_d, &node.min.x, &node.max.x, t_enter, t_exit);
+    }
+};
+
+
+template <int W>
+struct PacketEntry {
+    vfloat<W> t_enter; // per lane, only closest_hit and any_hit use it
+    uint32_t node;
+    uint32_t lanes;    // a bit for every ray that hit the node
+};
+
+
+// Fresh intersect_leaves of the rays in `lanes`. The entries with a lane's bit are exactly the
+// stack that lane would have on its own, as long as it enters children in the packet's order;
+// lanes that hit two children and would enter them the other way round are returned without
+// results and their stacks untouched, to be traced alone.
+template <int W>
+static uint32_t intersect_leaves_packet(const BVH& bvh, const glm::vec3* o, const glm::vec3* d, int n, uint32_t lanes,
+                                        int* stack_size, uint32_t* stack, int stack_stride, const LeafTarget& out,
+                                        std::vector<PacketEntry<W>>& packet_stack) {
+    const Buffer<FlatNode>& flat_nodes = bvh.flat_nodes;
+    RayPacket<W> rays(o, d, n);
+    vfloat<W> t_enter, t_exit;
+
+    // rays that miss the root keep their stack, as in intersect_leaves
+    uint32_t alive = rays.test_box(flat_nodes[0], t_enter, t_exit) & lanes;
+    for (uint32_t bits = lanes & ~alive; bits; bits &= bits - 1) {
+        int lane = __builtin_ctz(bits);
+        out.mask[lane] = false;
+        out.leaf[lane] = -1;
+        out.t_enter[lane] = 0;
+        out.t_exit[lane] = 0;
+    }
+
+    PacketEntry<W> *entries = packet_stack.data();
+    int size = 0;
+    entries[size].node = 0;
+    entries[size++].lanes = alive;
+    uint32_t diverged = 0;
+
+    while (size > 0 && alive) {
+        size--;
+        uint32_t node_idx = entries[size].node;
+        uint32_t active = entries[size].lanes & alive;
+        if (!active) {
+            continue;
+        }
+        const FlatNode& node = flat_nodes[node_idx];
+
+        if (node.is_leaf()) {
+            uint32_t hit = rays.test_box(node, t_enter, t_exit);
+            alignas(64) float t1[W], t2[W];
+            t_enter.store(t1);
+            t_exit.store(t2);
+
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int lane = __builtin_ctz(bits);
+                uint32_t *lane_stack = stack + (size_t) lane * stack_stride;
+                int lane_size = 0;
+                for (int k = 0; k < size; k++) {
+                    if ((entries[k].lanes >> lane) & 1) {
+                        lane_stack[lane_size++] = entries[k].node;
+                    }
+                }
+                stack_size[lane] = lane_size;
+
+                bool mask = (hit >> lane) & 1;
+                out.mask[lane] = mask;
+                out.leaf[lane] = node_idx;
+                out.t_enter[lane] = mask ? t1[lane] : 0;
+                out.t_exit[lane] = mask ? t2[lane] : 0;
+            }
+            alive &= ~active;
+            continue;
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        vfloat<W> t1_l, t2_l, t1_r, t2_r;
+        uint32_t mask_l = rays.test_box(flat_nodes[left], t1_l, t2_l) & active;
+        uint32_t mask_r = rays.test_box(flat_nodes[right], t1_r, t2_r) & active;
+
+        // intersect_leaves enters the left child first if t1_l < t1_r, the right one otherwise
+        uint32_t both = mask_l & mask_r;
+        uint32_t left_first = movemask(t1_l < t1_r) & both;
+        bool packet_left_first = 2 * __builtin_popcount(left_first) > __builtin_popcount(both);
+        uint32_t other_order = packet_left_first ? both & ~left_first : left_first;
+        diverged |= other_order;
+        alive &= ~other_order;
+        mask_l &= ~other_order;
+        mask_r &= ~other_order;
+
+        if (packet_left_first) {
+            std::swap(left, right);
+            std::swap(mask_l, mask_r);
+        }
+
+        if (mask_l) {
+            entries[size].node = left;
+            entries[size++].lanes = mask_l;
+        }
+
+        if (mask_r) {
+            entries[size].node = right;
+            entries[size++].lanes = mask_r;
+        }
+    }
+
+    // the whole stack was taken without reaching a leaf
+    for (uint32_t bits = alive; bits; bits &= bits - 1) {
+        int lane = __builtin_ctz(bits);
+        stack_size[lane] = 0;
+        out.mask[lane] = false;
+        out.leaf[lane] = -1;
+        out.t_enter[lane] = 0;
+        out.t_exit[lane] = 0;
+    }
+
+    return diverged;
+}
+
+
+void BVH::intersect_leaves_packets(int n, const glm::vec3* o, const glm::vec3* d, int* stack_size, uint32_t* stack, int stack_stride,
+                                   const LeafTarget& out) {
+    constexpr int W = SIMD_WIDTH;
+    std::vector<PacketEntry<W>> packet_stack(build_params.layout == NodeLayout::Flat ? std::max(required_stack_size, 1) : 0);
+
+    for (int first = 0; first < n; first += W) {
+        int count = std::min(W, n - first);
+
+        uint32_t fresh = 0;
+        if (build_params.layout == NodeLayout::Flat) {
+            for (int lane = 0; lane < count; lane++) {
+                int i = first + lane;
+                if (stack_size[i] == 1 && stack[(size_t) i * stack_stride] == 0) {
+                    fresh |= 1u << lane;
+                }
+            }
+        }
+
+        uint32_t single = ((1u << count) - 1) & ~fresh;
+        if (__builtin_popcount(fresh) > 1) {
+            LeafTarget packet_out = {out.mask + first, out.leaf + first, out.t_enter + first, out.t_exit + first};
+            single |= intersect_leaves_packet<W>(*this, o + first, d + first, count, fresh, stack_size + first,
+                                                 stack + (size_t) first * stack_stride, stack_stride, packet_out, packet_stack);
+        } else {
+            single |= fresh;
+        }
+
+        for (; single; single &= single - 1) {
+            int i = first + __builtin_ctz(single);
+            std::tie(out.mask[i], out.leaf[i], out.t_enter[i], out.t_exit[i]) =
+                intersect_leaves(o[i], d[i], stack_size[i], stack + (size_t) i * stack_stride);
+        }
+    }
+}
+
+
+// closest_hit or any_hit of n <= W rays, the same culling as intersect_triangles per lane; any_hit
+// lanes leave the packet at their first hit
+template <bool AnyHit, int W>
+static void intersect_triangles_packet(const BVH& bvh, const glm::vec3* o, const glm::vec3* d, int n, float t_min, float t_max,
+                                       const HitTarget& out, std::vector<PacketEntry<W>>& packet_stack) {
+    const Buffer<FlatNode>& flat_nodes = bvh.flat_nodes;
+    RayPacket<W> rays(o, d, n);
+    vfloat<W> t_lo = vfloat<W>::broadcast(t_min);
+
+    alignas(64) float t_best[W], u_best[W], v_best[W];
+    int face[W];
+    std::fill(t_best, t_best + W, t_max);
+    std::fill(u_best, u_best + W, 0.0f);
+    std::fill(v_best, v_best + W, 0.0f);
+    std::fill(face, face + W, -1);
+    uint32_t found = 0;
+
+    vfloat<W> t_enter, t_exit;
+    uint32_t alive = rays.test_box_rcp(flat_nodes[0], t_enter, t_exit) & ((1u << n) - 1);
+    alive &= movemask(~((t_enter > vfloat<W>::load(t_best)) | (t_exit < t_lo)));
+
+    PacketEntry<W> *entries = packet_stack.data();
+    int size = 0;
+    entries[size].t_enter = t_enter;
+    entries[size].node = 0;
+    entries[size++].lanes = alive;
+
+    // tests every active lane against one triangle and keeps the hits
+    auto test_triangle = [&](const vfloat<W> v0[3], const vfloat<W> e1[3], const vfloat<W> e2[3], uint32_t face_index, uint32_t& active) {
+        vfloat<W> t, u, v;
+        uint32_t hits = ray_triangle_intersection<W>(rays.o, rays.d, v0, e1, e2, t, u, v) & active;
+        if (!hits) {
+            return;
+        }
+        hits &= movemask(~((t < t_lo) | (t > vfloat<W>::load(t_best))));
+
+        alignas(64) float ts[W], us[W], vs[W];
+        t.store(ts);
+        u.store(us);
+        v.store(vs);
+        for (uint32_t bits = hits; bits; bits &= bits - 1) {
+            int lane = __builtin_ctz(bits);
+            t_best[lane] = ts[lane];
+            u_best[lane] = us[lane];
+            v_best[lane] = vs[lane];
+            face[lane] = face_index;
+        }
+        found |= hits;
+        if (AnyHit) {
+            active &= ~hits;
+            alive &= ~hits;
+        }
+    };
+
+    while (size > 0 && alive) {
+        size--;
+        uint32_t node_idx = entries[size].node;
+        uint32_t active = entries[size].lanes & alive & movemask(~(entries[size].t_enter > vfloat<W>::load(t_best)));
+        if (!active) {
+            continue;
+        }
+        const FlatNode& node = flat_nodes[node_idx];
+
+        if (node.is_leaf() && !bvh.triangle_blocks.empty()) {
+            const TriangleBlock *block = &bvh.triangle_blocks[bvh.leaf_blocks[node_idx]];
+            for (int first = 0; first < node.count && active; first += TRIANGLE_BLOCK_SIZE, block++) {
+                for (int k = 0; k < std::min<int>(TRIANGLE_BLOCK_SIZE, node.count - first) && active; k++) {
+                    vfloat<W> v0[3], e1[3], e2[3];
+                    for (int axis = 0; axis < 3; axis++) {
+                        v0[axis] = vfloat<W>::broadcast(block->v0[axis][k]);
+                        e1[axis] = vfloat<W>::broadcast(block->e1[axis][k]);
+                        e2[axis] = vfloat<W>::broadcast(block->e2[axis][k]);
+                    }
+                    test_triangle(v0, e1, e2, block->face[k], active);
+                }
+            }
+            continue;
+        }
+
+        if (node.is_leaf()) {
+            for (uint32_t i = node.offset; i < node.offset + node.count && active; i++) {
+                const Face& f = bvh.mesh.faces[bvh.prim_indices[i]];
+                const glm::vec3& p0 = bvh.mesh.vertices[f.v1];
+                glm::vec3 edge1 = bvh.mesh.vertices[f.v2] - p0;
+                glm::vec3 edge2 = bvh.mesh.vertices[f.v3] - p0;
+
+                vfloat<W> v0[3], e1[3], e2[3];
+                for (int axis = 0; axis < 3; axis++) {
+                    v0[axis] = vfloat<W>::broadcast(p0[axis]);
+                    e1[axis] = vfloat<W>::broadcast(edge1[axis]);
+                    e2[axis] = vfloat<W>::broadcast(edge2[axis]);
+                }
+                test_triangle(v0, e1, e2, bvh.prim_indices[i], active);
+            }
+            continue;
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        vfloat<W> t1_l, t2_l, t1_r, t2_r;
+        vfloat<W> t_hi = vfloat<W>::load(t_best);
+        uint32_t mask_l = rays.test_box_rcp(flat_nodes[left], t1_l, t2_l) & active & movemask((t1_l <= t_hi) & (t2_l >= t_lo));
+        uint32_t mask_r = rays.test_box_rcp(flat_nodes[right], t1_r, t2_r) & active & movemask((t1_r <= t_hi) & (t2_r >= t_lo));
+
+        // the child that more lanes enter first goes on top
+        uint32_t left_first = movemask(t1_l < t1_r) & mask_l & mask_r;
+        uint32_t votes_l = left_first | (mask_l & ~mask_r);
+        uint32_t votes_r = (mask_r & ~left_first);
+        if (__builtin_popcount(votes_l) > __builtin_popcount(votes_r)) {
+            std::swap(left, right);
+            std::swap(mask_l, mask_r);
+            std::swap(t1_l, t1_r);
+        }
+
+        if (mask_l) {
+            entries[size].t_enter = t1_l;
+            entries[size].node = left;
+            entries[size++].lanes = mask_l;
+        }
+
+        if (mask_r) {
+            entries[size].t_enter = t1_r;
+            entries[size].node = right;
+            entries[size++].lanes = mask_r;
+        }
+    }
+
+    for (int lane = 0; lane < n; lane++) {
+        out.mask[lane] = (found >> lane) & 1;
+        out.face[lane] = face[lane];
+        out.t[lane] = t_best[lane];
+        if (out.barycentrics) {
+            out.barycentrics[2 * lane] = u_best[lane];
+            out.barycentrics[2 * lane + 1] = v_best[lane];
+        }
+    }
+}
+
+
+template <bool AnyHit>
+static void intersect_triangles_packets(const BVH& bvh, int n, const glm::vec3* o, const glm::vec3* d, float t_min, float t_max,
+                                        const HitTarget& out) {
+    constexpr int W = SIMD_WIDTH;
+    std::vector<PacketEntry<W>> packet_stack(std::max(bvh.required_stack_size, 1));
+
+    for (int first = 0; first < n; first += W) {
+        HitTarget packet_out = {out.mask + first, out.face + first, out.t + first, out.barycentrics ? out.barycentrics + 2 * first : nullptr};
+        intersect_triangles_packet<AnyHit, W>(bvh, o + first, d + first, std::min(W, n - first), t_min, t_max, packet_out, packet_stack);
+    }
+}
+
+
+void BVH::closest_hit_packets(int n, const glm::vec3* o, const glm::vec3* d, float t_min, float t_max, const HitTarget& out) {
+    intersect_triangles_packets<false>(*this, n, o, d, t_min, t_max, out);
+}
+
+
+void BVH::any_hit_packets(int n, const glm::vec3* o, const glm::vec3* d, float t_min, float t_max, const HitTarget& out) {
+    intersect_triangles_packets<true>(*this, n, o, d, t_min, t_max, out);
+}
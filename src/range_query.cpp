@@ -0,0 +1,179 @@
+// Overlap (range) queries: faces or leaves touching a box or a sphere, one at a time or in
+// batches returned in CSR form.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int QUERIES_PER_TASK = 256;
+
+
+static bool sphere_overlaps_box(const glm::vec3& center, float radius2, const glm::vec3& min, const glm::vec3& max) {
+    glm::vec3 d = glm::max(glm::max(min - center, center - max), glm::vec3(0));
+    return glm::dot(d, d) <= radius2;
+}
+
+
+// depth-first over the nodes whose boxes pass overlaps(min, max), with face_overlaps(face) tested
+// on the faces of the leaves it reaches; leaf node indices instead of faces if leaves is set
+template <typename Overlaps, typename FaceOverlaps>
+static void query_overlapping(const BVH& bvh, const Overlaps& overlaps, const FaceOverlaps& face_overlaps, bool leaves, std::vector<int>& ids) {
+    if (bvh.flat_nodes.empty() || !overlaps(bvh.flat_nodes[0].min, bvh.flat_nodes[0].max)) {
+        return;
+    }
+
+    int first = ids.size();
+    std::vector<uint32_t> stack;
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty()) {
+        uint32_t node_idx = stack.back();
+        stack.pop_back();
+        const FlatNode& node = bvh.flat_nodes[node_idx];
+
+        if (node.is_leaf()) {
+            if (leaves) {
+                ids.push_back(node_idx);
+                continue;
+            }
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                if (face_overlaps(bvh.mesh.faces[bvh.prim_indices[i]])) {
+                    ids.push_back(bvh.prim_indices[i]);
+                }
+            }
+            continue;
+        }
+
+        for (uint32_t child : {node.offset, node_idx + 1}) {
+            if (overlaps(bvh.flat_nodes[child].min, bvh.flat_nodes[child].max)) {
+                stack.push_back(child);
+            }
+        }
+    }
+
+    // SBVH trees may reference a face from several leaves
+    if (!leaves && bvh.prim_indices.size() > bvh.mesh.faces.size()) {
+        std::sort(ids.begin() + first, ids.end());
+        ids.erase(std::unique(ids.begin() + first, ids.end()), ids.end());
+    }
+}
+
+
+void BVH::query_aabb(const glm::vec3& min, const glm::vec3& max, bool leaves, std::vector<int>& ids) {
+    auto overlaps = [&](const glm::vec3& node_min, const glm::vec3& node_max) {
+        return boxes_overlap(min, max, node_min, node_max);
+    };
+    auto face_overlaps = [&](const Face& f) {
+        const glm::vec3& v0 = mesh.vertices[f.v1];
+        const glm::vec3& v1 = mesh.vertices[f.v2];
+        const glm::vec3& v2 = mesh.vertices[f.v3];
+        if (!boxes_overlap(min, max, glm::min(v0, glm::min(v1, v2)), glm::max(v0, glm::max(v1, v2)))) {
+            return false;
+        }
+        glm::vec3 poly[9];
+        return clip_triangle(v0, v1, v2, min, max, poly) > 0;
+    };
+    query_overlapping(*this, overlaps, face_overlaps, leaves, ids);
+}
+
+
+void BVH::query_sphere(const glm::vec3& center, float radius, bool leaves, std::vector<int>& ids) {
+    if (!(radius >= 0)) {
+        return;
+    }
+    float radius2 = radius * radius;
+
+    auto overlaps = [&](const glm::vec3& node_min, const glm::vec3& node_max) {
+        return sphere_overlaps_box(center, radius2, node_min, node_max);
+    };
+    auto face_overlaps = [&](const Face& f) {
+        const glm::vec3& v0 = mesh.vertices[f.v1];
+        const glm::vec3& v1 = mesh.vertices[f.v2];
+        const glm::vec3& v2 = mesh.vertices[f.v3];
+        auto [u, v] = closest_point_triangle(center, v0, v1, v2);
+        glm::vec3 q = v0 + u * (v1 - v0) + v * (v2 - v0);
+        return glm::dot(q - center, q - center) <= radius2;
+    };
+    query_overlapping(*this, overlaps, face_overlaps, leaves, ids);
+}
+
+
+// runs query(i, ids) for every query, chunks of queries in parallel, and gathers the results in input order
+template <typename Query>
+static void query_batch(const BVH& bvh, int n, const glm::vec3 *centers, bool sort_queries, int n_threads,
+                        std::vector<int64_t>& offsets, std::vector<int>& ids, const Query& query) {
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    if (sort_queries && n > 1 && !bvh.flat_nodes.empty()) {
+        glm::vec3 min = bvh.flat_nodes[0].min;
+        glm::vec3 scale = 1.0f / glm::max(bvh.flat_nodes[0].max - min, glm::vec3(FLT_MIN));
+        std::vector<std::pair<uint64_t, int>> codes(n);
+        for (int i = 0; i < n; i++) {
+            // infinite centers are clamped into the grid, NaN ones would reach the float to integer
+            // casts of morton_code, so they are sorted last instead
+            glm::vec3 p = (centers[i] - min) * scale;
+            bool nan = std::isnan(p.x) || std::isnan(p.y) || std::isnan(p.z);
+            codes[i] = {nan ? UINT64_MAX : morton_code(p, 30), i};
+        }
+        std::sort(codes.begin(), codes.end());
+        for (int i = 0; i < n; i++) {
+            order[i] = codes[i].second;
+        }
+    }
+
+    ThreadPool& pool = shared_thread_pool(n > QUERIES_PER_TASK ? n_threads : 1);
+    std::vector<std::vector<int>> chunk_ids((n + QUERIES_PER_TASK - 1) / QUERIES_PER_TASK);
+    std::vector<int> counts(n);
+    pool.parallel_for(0, n, QUERIES_PER_TASK, [&](int begin, int end) {
+        std::vector<int>& local = chunk_ids[begin / QUERIES_PER_TASK];
+        for (int k = begin; k < end; k++) {
+            int before = local.size();
+            query(order[k], local);
+            counts[order[k]] = local.size() - before;
+        }
+    });
+
+    offsets.assign(n + 1, 0);
+    for (int i = 0; i < n; i++) {
+        offsets[i + 1] = offsets[i] + counts[i];
+    }
+
+    ids.resize(offsets[n]);
+    pool.parallel_for(0, n, QUERIES_PER_TASK, [&](int begin, int end) {
+        const std::vector<int>& local = chunk_ids[begin / QUERIES_PER_TASK];
+        int next = 0;
+        for (int k = begin; k < end; k++) {
+            int i = order[k];
+            std::copy(local.begin() + next, local.begin() + next + counts[i], ids.begin() + offsets[i]);
+            next += counts[i];
+        }
+    });
+}
+
+
+void BVH::query_aabbs(int n, const glm::vec3* mins, const glm::vec3* maxs, bool leaves, bool sort_queries, int n_threads,
+                      std::vector<int64_t>& offsets, std::vector<int>& ids) {
+    std::vector<glm::vec3> centers(sort_queries ? n : 0);
+    for (int i = 0; i < centers.size(); i++) {
+        centers[i] = (mins[i] + maxs[i]) * 0.5f;
+    }
+    query_batch(*this, n, centers.data(), sort_queries, n_threads, offsets, ids, [&](int i, std::vector<int>& out) {
+        query_aabb(mins[i], maxs[i], leaves, out);
+    });
+}
+
+
+void BVH::query_spheres(int n, const glm::vec3* centers, const float* radii, bool leaves, bool sort_queries, int n_threads,
+                        std::vector<int64_t>& offsets, std::vector<int>& ids) {
+    query_batch(*this, n, centers, sort_queries, n_threads, offsets, ids, [&](int i, std::vector<int>& out) {
+        query_sphere(centers[i], radii[i], leaves, out);
+    });
+}
@@ -0,0 +1,205 @@
+// Refit for deforming meshes: vertices move, the tree keeps its topology and only bounds
+// are recomputed. In the depth-first order of flat_nodes every subtree is one contiguous
+// range with children behind their parent, so a range is refit by walking it backwards.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int REFIT_TASK_NODES = 1 << 12; // smaller subtrees are refit by one thread
+
+
+// one past the last node of the subtree at `node`
+static int subtree_end(const Buffer<FlatNode>& flat_nodes, int node) {
+    while (!flat_nodes[node].is_leaf()) {
+        node = flat_nodes[node].offset;
+    }
+    return node + 1;
+}
+
+
+// children of inner nodes must be refit already, cost gets the SAH cost of the subtree
+static void refit_node(BVH& bvh, std::vector<float>& cost, int i) {
+    FlatNode& node = bvh.flat_nodes[i];
+
+    if (node.is_leaf()) {
+        glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+        for (int k = node.offset; k < node.offset + node.count; k++) {
+            const Face& face = bvh.mesh.faces[bvh.prim_indices[k]];
+            min = glm::min(min, glm::min(bvh.mesh.vertices[face.v1], glm::min(bvh.mesh.vertices[face.v2], bvh.mesh.vertices[face.v3])));
+            max = glm::max(max, glm::max(bvh.mesh.vertices[face.v1], glm::max(bvh.mesh.vertices[face.v2], bvh.mesh.vertices[face.v3])));
+        }
+        node.min = min;
+        node.max = max;
+        cost[i] = box_area(min, max) * node.count * TRIANGLE_INTERSECTION_COST;
+        return;
+    }
+
+    const FlatNode& left = bvh.flat_nodes[i + 1];
+    const FlatNode& right = bvh.flat_nodes[node.offset];
+    node.min = glm::min(left.min, right.min);
+    node.max = glm::max(left.max, right.max);
+    cost[i] = box_area(node.min, node.max) * TRAVERSAL_COST + cost[i + 1] + cost[node.offset];
+}
+
+
+void BVH::refit_subtree(ThreadPool& pool, std::vector<float>& cost, int node, int end) {
+    if (pool.size() == 1 || end - node <= REFIT_TASK_NODES) {
+        for (int i = end - 1; i >= node; i--) {
+            refit_node(*this, cost, i);
+        }
+        return;
+    }
+
+    int right = flat_nodes[node].offset;
+    {
+        TaskGroup group(pool);
+        group.run([this, &pool, &cost, node, right]() {
+            refit_subtree(pool, cost, node + 1, right);
+        });
+        refit_subtree(pool, cost, right, end);
+        group.wait();
+    }
+    refit_node(*this, cost, node);
+}
+
+
+// SAH cost of every subtree relative to its own box, stays the same under rigid motion and scaling
+static void relative_costs(const Buffer<FlatNode>& flat_nodes, const std::vector<float>& cost, std::vector<float>& out) {
+    out.resize(flat_nodes.size());
+    for (int i = 0; i < flat_nodes.size(); i++) {
+        float area = box_area(flat_nodes[i].min, flat_nodes[i].max);
+        out[i] = area > 0 ? cost[i] / area : 0;
+    }
+}
+
+
+float BVH::refit(Buffer<glm::vec3> vertices, float rebuild_fraction) {
+    if (flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+    if (vertices.size() != mesh.vertices.size()) {
+        throw std::runtime_error("refit needs as many vertices as the mesh has");
+    }
+
+    ThreadPool& pool = shared_thread_pool(build_params.n_threads);
+    std::vector<float> cost(flat_nodes.size());
+
+    // the tree as it is before the first refit is the reference for rebuild decisions
+    if (build_costs.empty()) {
+        refit_subtree(pool, cost, 0, flat_nodes.size());
+        relative_costs(flat_nodes, cost, build_costs);
+        if (build_sah == 0) {
+            build_sah = build_costs[0];
+        }
+    }
+
+    mesh.vertices = std::move(vertices);
+    refit_subtree(pool, cost, 0, flat_nodes.size());
+
+    if (rebuild_fraction > 0) {
+        rebuild_worst_subtrees(pool, cost, rebuild_fraction);
+    } else {
+        // trees loaded in the Flat layout have no nodes, but their triangle blocks still hold the old vertices
+        pool.parallel_for(0, nodes.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+            for (int i = begin; i < end; i++) {
+                nodes[i].min = flat_nodes[i].min;
+                nodes[i].max = flat_nodes[i].max;
+            }
+        });
+        fill_layout();
+    }
+
+    return sah_growth();
+}
+
+
+void BVH::rebuild_worst_subtrees(ThreadPool& pool, const std::vector<float>& cost, float rebuild_fraction) {
+    if (nodes.empty()) {
+        restore_nodes();
+    }
+
+    int n = flat_nodes.size();
+    std::vector<int> node_depth(n);
+    for (int i = 0; i < n; i++) {
+        nodes[i].min = flat_nodes[i].min;
+        nodes[i].max = flat_nodes[i].max;
+        if (!flat_nodes[i].is_leaf()) {
+            node_depth[i + 1] = node_depth[i] + 1;
+            node_depth[flat_nodes[i].offset] = node_depth[i] + 1;
+        }
+    }
+
+    // candidates are ranked by SAH cost above their reference per face, so that one large
+    // subtree doesn't win only because it contains the degraded ones
+    std::vector<std::tuple<float, int>> candidates; // excess cost per face, node
+    for (int i = 0; i < n; i++) {
+        if (nodes[i].is_leaf() || nodes[i].count <= build_params.max_leaf_size) {
+            continue;
+        }
+        float excess = cost[i] - build_costs[i] * box_area(nodes[i].min, nodes[i].max);
+        if (excess > 0) {
+            candidates.push_back({excess / nodes[i].count, i});
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), std::greater<>());
+
+    // take disjoint subtrees until the face budget runs out
+    int budget = rebuild_fraction * mesh.faces.size();
+    std::vector<std::tuple<int, int>> chosen; // node, subtree end
+    for (auto [excess, node] : candidates) {
+        if (nodes[node].count > budget) {
+            continue;
+        }
+        int end = subtree_end(flat_nodes, node);
+        bool disjoint = std::all_of(chosen.begin(), chosen.end(), [&](const std::tuple<int, int>& other) {
+            return end <= std::get<0>(other) || node >= std::get<1>(other);
+        });
+        if (disjoint) {
+            chosen.push_back({node, end});
+            budget -= nodes[node].count;
+        }
+    }
+
+    if (!chosen.empty()) {
+        BinnedBuild build;
+        build.indices = prim_indices.data();
+        compute_face_bounds(pool, build.bounds);
+
+        std::vector<std::vector<BVHNode>> subtrees(chosen.size());
+        {
+            TaskGroup group(pool);
+            for (int k = 0; k < chosen.size(); k++) {
+                group.run([&, k]() {
+                    int node = std::get<0>(chosen[k]);
+                    BVHNode root = nodes[node];
+                    root.left = -1;
+                    root.right = -1;
+                    subtrees[k].push_back(root);
+                    int depth = std::max(build_params.depth - node_depth[node], 0);
+                    grow_bvh_binned(subtrees[k], 0, depth, build, root.first, root.count);
+                });
+            }
+            group.wait();
+        }
+
+        // old descendants of the chosen nodes become unreachable and are dropped by finalize
+        for (int k = 0; k < chosen.size(); k++) {
+            splice_subtree(std::get<0>(chosen[k]), subtrees[k]);
+        }
+        finalize(build_params.layout);
+
+        // the whole tree becomes the new reference for later rebuilds, sah_growth() still compares with the build
+        std::vector<float> new_cost(flat_nodes.size());
+        refit_subtree(pool, new_cost, 0, flat_nodes.size());
+        relative_costs(flat_nodes, new_cost, build_costs);
+    } else {
+        fill_layout();
+    }
+}
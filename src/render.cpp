@@ -0,0 +1,113 @@
+// Image rendering without ray arrays: rays are generated per pixel, and pixels are traced in
+// small square tiles so that neighbouring rays, which visit mostly the same nodes, run together
+// on one thread. Tiles are taken in Morton order over the screen, and the pixels of a tile in
+// Morton order too, so that every SIMD packet of rays covers a small square of the tile.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+const int TILE_SIZE = 16;      // 256 rays per tile
+const int TILES_PER_TASK = 4;
+
+
+void BVH::render(const Camera& camera, int width, int height, RenderMode mode, const RenderTarget& target, int n_threads) {
+    if (flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("width and height must be positive");
+    }
+
+    int tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    int n_tiles = tiles_x * tiles_y;
+
+    // square cells, so that the curve doesn't stretch along the longer side
+    float cells = std::max(tiles_x, tiles_y);
+    std::vector<std::pair<uint64_t, int>> tiles(n_tiles);
+    for (int i = 0; i < n_tiles; i++) {
+        glm::vec3 p((i % tiles_x + 0.5f) / cells, (i / tiles_x + 0.5f) / cells, 0);
+        tiles[i] = {morton_code(p, 30), i};
+    }
+    std::sort(tiles.begin(), tiles.end());
+
+    ThreadPool& pool = shared_thread_pool(n_tiles > TILES_PER_TASK ? n_threads : 1);
+    pool.parallel_for(0, n_tiles, TILES_PER_TASK, [&](int begin, int end) {
+        const int n = TILE_SIZE * TILE_SIZE;
+        int stride = std::max(required_stack_size, 1);
+        std::vector<glm::vec3> origins(n), directions(n);
+        std::vector<int> pixels(n), stack_size(mode == RenderMode::FirstLeaf ? n : 0);
+        std::vector<uint32_t> stack(mode == RenderMode::FirstLeaf ? n * stride : 0);
+        std::unique_ptr<bool[]> mask(new bool[n]);
+        std::vector<int> ids(n);
+        std::vector<float> t_enter(n), t_exit(n);
+
+        for (int k = begin; k < end; k++) {
+            int tile = tiles[k].second;
+            int x0 = tile % tiles_x * TILE_SIZE, y0 = tile / tiles_x * TILE_SIZE;
+
+            int n_rays = 0;
+            for (int m = 0; m < n; m++) {
+                int x = x0, y = y0;
+                for (int bit = 0; (1 << bit) < TILE_SIZE; bit++) {
+                    x += ((m >> (2 * bit)) & 1) << bit;
+                    y += ((m >> (2 * bit + 1)) & 1) << bit;
+                }
+                if (x >= width || y >= height) {
+                    continue;
+                }
+
+                float u = 2 * (x + 0.5f) / width - 1;
+                float v = 1 - 2 * (y + 0.5f) / height;
+                glm::vec3 o = camera.origin, d = camera.forward;
+                if (camera.projection == Projection::Pinhole) {
+                    d += u * camera.right + v * camera.up;
+                } else {
+                    o += u * camera.right + v * camera.up;
+                }
+
+                origins[n_rays] = o;
+                directions[n_rays] = d;
+                pixels[n_rays] = y * width + x;
+                if (mode == RenderMode::FirstLeaf) {
+                    stack_size[n_rays] = 1;
+                    stack[n_rays * stride] = 0;
+                }
+                n_rays++;
+            }
+
+            if (mode == RenderMode::FirstLeaf) {
+                LeafTarget out = {mask.get(), ids.data(), t_enter.data(), t_exit.data()};
+                intersect_leaves_packets(n_rays, origins.data(), directions.data(), stack_size.data(), stack.data(), stride, out);
+            } else {
+                HitTarget out = {mask.get(), ids.data(), t_enter.data()};
+                closest_hit_packets(n_rays, origins.data(), directions.data(), 0, FLT_MAX, out);
+                std::fill(t_exit.begin(), t_exit.begin() + n_rays, 0.0f);
+            }
+
+            for (int i = 0; i < n_rays; i++) {
+                int pixel = pixels[i];
+                if (target.mask) {
+                    target.mask[pixel] = mask[i];
+                }
+                if (target.id) {
+                    target.id[pixel] = ids[i];
+                }
+                if (target.t_enter) {
+                    target.t_enter[pixel] = t_enter[i];
+                }
+                if (target.t_exit) {
+                    target.t_exit[pixel] = t_exit[i];
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,395 @@
+// Spatial split BVH (Stich et al. 2009). Besides binned object splits, nodes may be split by
+// a plane through space: faces crossing it are clipped and referenced from both children,
+// which removes the overlap large slanted faces cause. The build works on references, a
+// face index with the bounds of the part of the face it covers, so prim_indices may list a
+// face more than once, in different leaves.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "bvh.h"
+
+
+// spatial splits are only tried where the children of the best object split overlap by more
+// than this fraction of the root area, elsewhere they wouldn't gain anything
+const float SBVH_MIN_OVERLAP = 1e-5f;
+
+
+struct Reference {
+    glm::vec3 min, max;
+    unsigned face;
+};
+
+
+struct ObjectSplit {
+    float cost = FLT_MAX;
+    int axis = -1;
+    int bin = -1;
+    glm::vec3 centroid_min, scale;
+    glm::vec3 left_min, left_max, right_min, right_max;
+};
+
+
+struct SpatialSplit {
+    float cost = FLT_MAX;
+    int axis = -1;
+    float position;
+};
+
+
+struct SpatialBin {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+    int enter = 0, exit = 0; // references starting and ending in this bin
+};
+
+
+struct SBVHBuild {
+    const BuildParams& params;
+    const Mesh& mesh;
+    float root_area;
+    long budget; // duplicates still allowed
+    std::vector<unsigned> indices;
+};
+
+
+static glm::vec3 centroid(const Reference& ref) {
+    return (ref.min + ref.max) * 0.5f;
+}
+
+
+static int object_bin(const ObjectSplit& split, const Reference& ref, int n_bins) {
+    int axis = split.axis;
+    return std::min(n_bins - 1, (int) ((centroid(ref)[axis] - split.centroid_min[axis]) * split.scale[axis]));
+}
+
+
+// bounds of the part of the face of ref inside [min, max], false if nothing is left
+static bool clip_reference(const Mesh& mesh, const Reference& ref, const glm::vec3& min, const glm::vec3& max, Reference& out) {
+    const Face& face = mesh.faces[ref.face];
+    glm::vec3 poly[9];
+    int n = clip_triangle(mesh.vertices[face.v1], mesh.vertices[face.v2], mesh.vertices[face.v3], glm::max(min, ref.min), glm::min(max, ref.max), poly);
+    if (n == 0) {
+        return false;
+    }
+
+    out.face = ref.face;
+    out.min = poly[0];
+    out.max = poly[0];
+    for (int i = 1; i < n; i++) {
+        out.min = glm::min(out.min, poly[i]);
+        out.max = glm::max(out.max, poly[i]);
+    }
+    return true;
+}
+
+
+// the same binned SAH search as the binned builder does, on reference centroids
+static ObjectSplit find_object_split(const std::vector<Reference>& refs, float node_area, int n_bins) {
+    ObjectSplit split;
+    split.centroid_min = glm::vec3(FLT_MAX);
+    glm::vec3 centroid_max(-FLT_MAX);
+    for (const Reference& ref : refs) {
+        split.centroid_min = glm::min(split.centroid_min, centroid(ref));
+        centroid_max = glm::max(centroid_max, centroid(ref));
+    }
+    glm::vec3 extent = centroid_max - split.centroid_min;
+    for (int axis = 0; axis < 3; axis++) {
+        split.scale[axis] = extent[axis] > 0 ? n_bins / extent[axis] : 0;
+    }
+
+    std::vector<SpatialBin> bins(3 * n_bins); // enter counts references here
+    for (const Reference& ref : refs) {
+        glm::vec3 c = centroid(ref);
+        for (int axis = 0; axis < 3; axis++) {
+            int bin_i = std::min(n_bins - 1, (int) ((c[axis] - split.centroid_min[axis]) * split.scale[axis]));
+            SpatialBin& bin = bins[axis * n_bins + bin_i];
+            bin.min = glm::min(bin.min, ref.min);
+            bin.max = glm::max(bin.max, ref.max);
+            bin.enter++;
+        }
+    }
+
+    std::vector<SpatialBin> right(n_bins);
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0) {
+            continue;
+        }
+        const SpatialBin *axis_bins = &bins[axis * n_bins];
+
+        SpatialBin acc;
+        for (int i = n_bins - 1; i > 0; i--) {
+            acc.min = glm::min(acc.min, axis_bins[i].min);
+            acc.max = glm::max(acc.max, axis_bins[i].max);
+            acc.enter += axis_bins[i].enter;
+            right[i] = acc;
+        }
+
+        acc = SpatialBin();
+        for (int i = 0; i < n_bins - 1; i++) {
+            acc.min = glm::min(acc.min, axis_bins[i].min);
+            acc.max = glm::max(acc.max, axis_bins[i].max);
+            acc.enter += axis_bins[i].enter;
+            if (acc.enter == 0 || right[i + 1].enter == 0) {
+                continue;
+            }
+
+            float left_cost = box_area(acc.min, acc.max) * acc.enter * TRIANGLE_INTERSECTION_COST;
+            float right_cost = box_area(right[i + 1].min, right[i + 1].max) * right[i + 1].enter * TRIANGLE_INTERSECTION_COST;
+            float cost = TRAVERSAL_COST + (left_cost + right_cost) / std::max(node_area, FLT_MIN);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.bin = i;
+                split.left_min = acc.min;
+                split.left_max = acc.max;
+                split.right_min = right[i + 1].min;
+                split.right_max = right[i + 1].max;
+            }
+        }
+    }
+
+    return split;
+}
+
+
+// bins space uniformly along every axis, each reference is clipped to every bin it spans
+static SpatialSplit find_spatial_split(const SBVHBuild& build, const std::vector<Reference>& refs, const BVHNode& node) {
+    const int n_bins = build.params.n_bins;
+    float node_area = box_area(node.min, node.max);
+    SpatialSplit split;
+
+    std::vector<SpatialBin> bins(n_bins), right(n_bins);
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = node.min[axis];
+        float width = (node.max[axis] - lo) / n_bins;
+        if (width <= 0) {
+            continue;
+        }
+        auto bin_of = [&](float x) {
+            return std::clamp((int) ((x - lo) / width), 0, n_bins - 1);
+        };
+
+        std::fill(bins.begin(), bins.end(), SpatialBin());
+        for (const Reference& ref : refs) {
+            int first = bin_of(ref.min[axis]);
+            int last = bin_of(ref.max[axis]);
+            bins[first].enter++;
+            bins[last].exit++;
+            if (first == last) {
+                bins[first].min = glm::min(bins[first].min, ref.min);
+                bins[first].max = glm::max(bins[first].max, ref.max);
+                continue;
+            }
+
+            for (int b = first; b <= last; b++) {
+                glm::vec3 slab_min = ref.min, slab_max = ref.max;
+                slab_min[axis] = std::max(slab_min[axis], b == first ? ref.min[axis] : lo + b * width);
+                slab_max[axis] = std::min(slab_max[axis], b == last ? ref.max[axis] : lo + (b + 1) * width);
+                Reference piece;
+                if (clip_reference(build.mesh, ref, slab_min, slab_max, piece)) {
+                    bins[b].min = glm::min(bins[b].min, piece.min);
+                    bins[b].max = glm::max(bins[b].max, piece.max);
+                }
+            }
+        }
+
+        SpatialBin acc;
+        for (int i = n_bins - 1; i > 0; i--) {
+            acc.min = glm::min(acc.min, bins[i].min);
+            acc.max = glm::max(acc.max, bins[i].max);
+            acc.exit += bins[i].exit;
+            right[i] = acc;
+        }
+
+        acc = SpatialBin();
+        for (int i = 0; i < n_bins - 1; i++) {
+            acc.min = glm::min(acc.min, bins[i].min);
+            acc.max = glm::max(acc.max, bins[i].max);
+            acc.enter += bins[i].enter;
+            if (acc.enter == 0 || right[i + 1].exit == 0) {
+                continue;
+            }
+
+            float left_cost = box_area(acc.min, acc.max) * acc.enter * TRIANGLE_INTERSECTION_COST;
+            float right_cost = box_area(right[i + 1].min, right[i + 1].max) * right[i + 1].exit * TRIANGLE_INTERSECTION_COST;
+            float cost = TRAVERSAL_COST + (left_cost + right_cost) / std::max(node_area, FLT_MIN);
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.position = lo + (i + 1) * width;
+            }
+        }
+    }
+
+    return split;
+}
+
+
+static void grow_box(glm::vec3& min, glm::vec3& max, const Reference& ref) {
+    min = glm::min(min, ref.min);
+    max = glm::max(max, ref.max);
+}
+
+
+static float union_area(const glm::vec3& min, const glm::vec3& max, const Reference& ref) {
+    return box_area(glm::min(min, ref.min), glm::max(max, ref.max));
+}
+
+
+// references on one side of the plane stay whole; crossing ones are split in two, or moved
+// whole to one side when that is cheaper (reference unsplitting) or the budget is spent
+static void partition_spatial(SBVHBuild& build, const SpatialSplit& split, std::vector<Reference>& refs,
+                              std::vector<Reference>& left, std::vector<Reference>& right) {
+    int axis = split.axis;
+    glm::vec3 left_min(FLT_MAX), left_max(-FLT_MAX), right_min(FLT_MAX), right_max(-FLT_MAX);
+
+    std::vector<Reference> crossing;
+    for (const Reference& ref : refs) {
+        if (ref.max[axis] <= split.position) {
+            left.push_back(ref);
+            grow_box(left_min, left_max, ref);
+        } else if (ref.min[axis] >= split.position) {
+            right.push_back(ref);
+            grow_box(right_min, right_max, ref);
+        } else {
+            crossing.push_back(ref);
+        }
+    }
+
+    for (const Reference& ref : crossing) {
+        glm::vec3 plane_max = ref.max, plane_min = ref.min;
+        plane_max[axis] = split.position;
+        plane_min[axis] = split.position;
+        Reference left_part, right_part;
+        bool has_left = clip_reference(build.mesh, ref, ref.min, plane_max, left_part);
+        bool has_right = clip_reference(build.mesh, ref, plane_min, ref.max, right_part);
+
+        int n_left = left.size(), n_right = right.size();
+        float left_area = n_left > 0 ? box_area(left_min, left_max) : 0;
+        float right_area = n_right > 0 ? box_area(right_min, right_max) : 0;
+
+        float split_cost = FLT_MAX;
+        if (has_left && has_right && build.budget > 0) {
+            split_cost = union_area(left_min, left_max, left_part) * (n_left + 1) + union_area(right_min, right_max, right_part) * (n_right + 1);
+        }
+        float left_cost = union_area(left_min, left_max, ref) * (n_left + 1) + right_area * n_right;
+        float right_cost = left_area * n_left + union_area(right_min, right_max, ref) * (n_right + 1);
+
+        if (!has_right || (left_cost <= split_cost && left_cost <= right_cost && has_left)) {
+            left.push_back(ref);
+            grow_box(left_min, left_max, ref);
+        } else if (!has_left || right_cost <= split_cost) {
+            right.push_back(ref);
+            grow_box(right_min, right_max, ref);
+        } else {
+            left.push_back(left_part);
+            grow_box(left_min, left_max, left_part);
+            right.push_back(right_part);
+            grow_box(right_min, right_max, right_part);
+            build.budget--;
+        }
+    }
+}
+
+
+static void grow_sbvh(SBVHBuild& build, std::vector<BVHNode>& nodes, int node, int depth, std::vector<Reference>& refs) {
+    nodes[node].min = glm::vec3(FLT_MAX);
+    nodes[node].max = glm::vec3(-FLT_MAX);
+    for (const Reference& ref : refs) {
+        grow_box(nodes[node].min, nodes[node].max, ref);
+    }
+
+    auto make_leaf = [&]() {
+        nodes[node].first = build.indices.size();
+        nodes[node].count = refs.size();
+        for (const Reference& ref : refs) {
+            build.indices.push_back(ref.face);
+        }
+    };
+
+    int count = refs.size();
+    if (depth <= 0 || count <= 1) {
+        make_leaf();
+        return;
+    }
+
+    float node_area = box_area(nodes[node].min, nodes[node].max);
+    ObjectSplit object = find_object_split(refs, node_area, build.params.n_bins);
+
+    SpatialSplit spatial;
+    if (build.budget > 0) {
+        float overlap = 0;
+        if (object.axis != -1) {
+            glm::vec3 min = glm::max(object.left_min, object.right_min);
+            glm::vec3 max = glm::min(object.left_max, object.right_max);
+            overlap = min.x <= max.x && min.y <= max.y && min.z <= max.z ? box_area(min, max) : 0;
+        }
+        if (object.axis == -1 || overlap > SBVH_MIN_OVERLAP * build.root_area) {
+            spatial = find_spatial_split(build, refs, nodes[node]);
+        }
+    }
+
+    float cost = std::min(object.cost, spatial.cost);
+    if (cost == FLT_MAX || (cost >= count * TRIANGLE_INTERSECTION_COST && count <= build.params.max_leaf_size)) {
+        make_leaf();
+        return;
+    }
+
+    std::vector<Reference> left, right;
+    if (spatial.cost < object.cost) {
+        partition_spatial(build, spatial, refs, left, right);
+    }
+    // spatial partitions may end up one-sided after unsplitting
+    if (left.empty() || right.empty()) {
+        if (object.axis == -1) {
+            make_leaf();
+            return;
+        }
+        left.clear();
+        right.clear();
+        for (const Reference& ref : refs) {
+            (object_bin(object, ref, build.params.n_bins) <= object.bin ? left : right).push_back(ref);
+        }
+    }
+
+    #ifdef DEBUG
+    cout << "Splitting " << count << " references into " << left.size() << " and " << right.size() << (spatial.cost < object.cost ? " in space" : "") << endl;
+    #endif
+
+    // references of this node aren't needed anymore, children may hold a lot of them
+    std::vector<Reference>().swap(refs);
+
+    int left_node = nodes.size();
+    nodes.push_back(BVHNode());
+    nodes[node].left = left_node;
+    grow_sbvh(build, nodes, left_node, depth - 1, left);
+
+    int right_node = nodes.size();
+    nodes.push_back(BVHNode());
+    nodes[node].right = right_node;
+    grow_sbvh(build, nodes, right_node, depth - 1, right);
+
+    nodes[node].first = nodes[left_node].first;
+    nodes[node].count = nodes[left_node].count + nodes[right_node].count;
+}
+
+
+void BVH::build_bvh_sbvh(const BuildParams& params) {
+    std::vector<Reference> refs(mesh.faces.size());
+    for (int i = 0; i < mesh.faces.size(); i++) {
+        const Face& face = mesh.faces[i];
+        refs[i].min = glm::min(mesh.vertices[face.v1], glm::min(mesh.vertices[face.v2], mesh.vertices[face.v3]));
+        refs[i].max = glm::max(mesh.vertices[face.v1], glm::max(mesh.vertices[face.v2], mesh.vertices[face.v3]));
+        refs[i].face = i;
+    }
+
+    SBVHBuild build{params, mesh, box_area(nodes[0].min, nodes[0].max), (long) (params.duplication_budget * mesh.faces.size()), {}};
+    build.indices.reserve(mesh.faces.size() + std::max(build.budget, 0L));
+    grow_sbvh(build, nodes, 0, params.depth, refs);
+
+    prim_indices.resize(build.indices.size());
+    std::copy(build.indices.begin(), build.indices.end(), prim_indices.begin());
+}
@@ -0,0 +1,369 @@
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "scene.h"
+
+
+static glm::vec3 transform_point(const float m[3][4], const glm::vec3& p) {
+    return glm::vec3(
+        m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+        m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+        m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]
+    );
+}
+
+
+static glm::vec3 transform_vector(const float m[3][4], const glm::vec3& v) {
+    return glm::vec3(
+        m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+        m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+        m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z
+    );
+}
+
+
+// inverse of [A | t] is [A^-1 | -A^-1 t]
+static void invert_transform(const float m[3][4], float inv[3][4]) {
+    float c[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            c[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+        }
+    }
+    float det = m[0][0] * c[0][0] + m[0][1] * c[0][1] + m[0][2] * c[0][2];
+    if (!std::isfinite(det) || std::abs(det) < 1e-12f) {
+        throw std::runtime_error("instance transform is not invertible");
+    }
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            inv[i][j] = c[j][i] / det;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        inv[i][3] = -(inv[i][0] * m[0][3] + inv[i][1] * m[1][3] + inv[i][2] * m[2][3]);
+    }
+}
+
+
+static void set_transform(Instance& instance, const float transform[3][4]) {
+    invert_transform(transform, instance.inverse);
+    std::copy(&transform[0][0], &transform[0][0] + 12, &instance.transform[0][0]);
+}
+
+
+static void check_id(const Scene& scene, int id) {
+    if (id < 0 || id >= scene.instances.size() || !scene.instances[id].bvh) {
+        throw std::runtime_error("no instance with id " + std::to_string(id));
+    }
+}
+
+
+int Scene::add_instance(std::shared_ptr<BVH> bvh, const float transform[3][4]) {
+    if (!bvh || bvh->flat_nodes.empty()) {
+        throw std::runtime_error("instances need a built BVH");
+    }
+
+    Instance instance;
+    set_transform(instance, transform);
+    instance.bvh = std::move(bvh);
+
+    int id;
+    if (!free_ids.empty()) {
+        id = free_ids.back();
+        free_ids.pop_back();
+        instances[id] = std::move(instance);
+    } else {
+        id = instances.size();
+        instances.push_back(std::move(instance));
+    }
+    dirty = true;
+    return id;
+}
+
+
+void Scene::update_instance(int id, const float transform[3][4]) {
+    check_id(*this, id);
+    set_transform(instances[id], transform);
+    dirty = true;
+}
+
+
+void Scene::remove_instance(int id) {
+    check_id(*this, id);
+    instances[id].bvh.reset();
+    free_ids.push_back(id);
+    dirty = true;
+}
+
+
+void Scene::build() {
+    // bottom-level trees of empty meshes have an inverted root box, transforming it would put
+    // inf and NaN into the top-level bounds; they can't be hit, so they are left out
+    top_ids.clear();
+    for (int id = 0; id < instances.size(); id++) {
+        if (!instances[id].bvh) {
+            continue;
+        }
+        const FlatNode& root = instances[id].bvh->flat_nodes[0];
+        if (root.min.x <= root.max.x && root.min.y <= root.max.y && root.min.z <= root.max.z) {
+            top_ids.push_back(id);
+        }
+    }
+
+    // no top level at all, queries check top_ids before they touch it
+    if (top_ids.empty()) {
+        top = BVH();
+        required_stack_size = 1;
+        dirty = false;
+        return;
+    }
+
+    std::vector<FaceBounds> bounds(top_ids.size());
+    for (int i = 0; i < top_ids.size(); i++) {
+        const Instance& instance = instances[top_ids[i]];
+        FaceBounds& b = bounds[i];
+        b.min = glm::vec3(FLT_MAX);
+        b.max = glm::vec3(-FLT_MAX);
+
+        const FlatNode& root = instance.bvh->flat_nodes[0];
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 p(corner & 1 ? root.max.x : root.min.x,
+                        corner & 2 ? root.max.y : root.min.y,
+                        corner & 4 ? root.max.z : root.min.z);
+            p = transform_point(instance.transform, p);
+            b.min = glm::min(b.min, p);
+            b.max = glm::max(b.max, p);
+        }
+        b.centroid = (b.min + b.max) * 0.5f;
+    }
+
+    BuildParams params;
+    params.depth = 32;
+    params.max_leaf_size = 1;
+    params.n_threads = 1;
+    top.build_over_bounds(std::move(bounds), params);
+
+    // top-level stack, the instances of one top-level leaf, then the largest bottom-level stack with its size and id
+    uint32_t max_leaf_size = 0;
+    for (const FlatNode& node : top.flat_nodes) {
+        if (node.is_leaf()) {
+            max_leaf_size = std::max(max_leaf_size, node.count);
+        }
+    }
+    int max_bottom_stack = 0;
+    for (int id : top_ids) {
+        max_bottom_stack = std::max(max_bottom_stack, instances[id].bvh->required_stack_size);
+    }
+    required_stack_size = top.required_stack_size + max_leaf_size + max_bottom_stack + 2;
+    dirty = false;
+}
+
+
+// calls visit(id, object space origin, object space direction, t_max) for every instance in
+// the top-level leaves hit by the ray, nearer subtrees first; visit returns the new t_max
+template <typename Visit>
+static void traverse_instances(const Scene& scene, const glm::vec3& o, const glm::vec3& d, float t_min, float t_max, Visit visit) {
+    const Buffer<FlatNode>& flat_nodes = scene.top.flat_nodes;
+    if (scene.top_ids.empty()) {
+        return;
+    }
+
+    auto [root_mask, root_t1, root_t2] = ray_box_intersection(o, d, flat_nodes[0].min, flat_nodes[0].max);
+    if (!root_mask || root_t1 > t_max || root_t2 < t_min) {
+        return;
+    }
+
+    uint32_t local_stack[64];
+    float local_t[64];
+    std::vector<uint32_t> heap_stack;
+    std::vector<float> heap_t;
+    uint32_t *stack = local_stack;
+    float *stack_t = local_t;
+    if (scene.top.required_stack_size > 64) {
+        heap_stack.resize(scene.top.required_stack_size);
+        heap_t.resize(scene.top.required_stack_size);
+        stack = heap_stack.data();
+        stack_t = heap_t.data();
+    }
+
+    int stack_size = 0;
+    stack[stack_size] = 0;
+    stack_t[stack_size++] = root_t1;
+
+    while (stack_size > 0) {
+        stack_size--;
+        uint32_t node_idx = stack[stack_size];
+        if (stack_t[stack_size] > t_max) {
+            continue;
+        }
+        const FlatNode& node = flat_nodes[node_idx];
+
+        if (node.is_leaf()) {
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+                int id = scene.top_ids[scene.top.prim_indices[i]];
+                const Instance& instance = scene.instances[id];
+                glm::vec3 o_local = transform_point(instance.inverse, o);
+                glm::vec3 d_local = transform_vector(instance.inverse, d);
+                t_max = visit(id, o_local, d_local, t_max);
+                if (t_max < t_min) {
+                    return;
+                }
+            }
+            continue;
+        }
+
+        uint32_t left = node_idx + 1;
+        uint32_t right = node.offset;
+
+        auto [mask_l, t1_l, t2_l] = ray_box_intersection(o, d, flat_nodes[left].min, flat_nodes[left].max);
+        auto [mask_r, t1_r, t2_r] = ray_box_intersection(o, d, flat_nodes[right].min, flat_nodes[right].max);
+        mask_l = mask_l && t1_l <= t_max && t2_l >= t_min;
+        mask_r = mask_r && t1_r <= t_max && t2_r >= t_min;
+
+        if (mask_l && mask_r && t1_l < t1_r) {
+            std::swap(left, right);
+            std::swap(t1_l, t1_r);
+        }
+
+        if (mask_l) {
+            stack[stack_size] = left;
+            stack_t[stack_size++] = t1_l;
+        }
+
+        if (mask_r) {
+            stack[stack_size] = right;
+            stack_t[stack_size++] = t1_r;
+        }
+    }
+}
+
+
+template <bool AnyHit>
+std::tuple<bool, int, int, float, float, float> // mask, instance id, face index, t, u, v
+Scene::intersect_triangles(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max) {
+    bool found = false;
+    int instance = -1, face = -1;
+    float t_best = t_max, u_best = 0, v_best = 0;
+
+    traverse_instances(*this, o, d, t_min, t_max, [&](int id, const glm::vec3& o_local, const glm::vec3& d_local, float t_cur) {
+        BVH& bvh = *instances[id].bvh;
+        auto [hit, f, t, u, v] = AnyHit ? bvh.any_hit(o_local, d_local, t_min, t_cur) : bvh.closest_hit(o_local, d_local, t_min, t_cur);
+        if (!hit) {
+            return t_cur;
+        }
+
+        found = true;
+        instance = id;
+        face = f;
+        t_best = t;
+        u_best = u;
+        v_best = v;
+        // a negative t_max stops the traversal after the first hit
+        return AnyHit ? -FLT_MAX : t_best;
+    });
+
+    return {found, instance, face, t_best, u_best, v_best};
+}
+
+
+std::tuple<bool, int, int, float, float, float> // mask, instance id, face index, t, u, v
+Scene::closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max) {
+    return intersect_triangles<false>(o, d, t_min, t_max);
+}
+
+
+std::tuple<bool, int, int, float, float, float> // mask, instance id, face index, t, u, v
+Scene::any_hit(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max) {
+    return intersect_triangles<true>(o, d, t_min, t_max);
+}
+
+
+std::tuple<bool, int, int, float, float> // mask, instance id, leaf index, t_enter, t_exit
+Scene::intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack) {
+    if (top_ids.empty()) {
+        return {false, -1, -1, 0, 0};
+    }
+
+    while (stack_size > 0) {
+        uint32_t entry = stack[stack_size - 1];
+
+        if (entry & SCENE_ENTERED) {
+            int id = entry & ~SCENE_ENTERED;
+            int bottom_size = stack[stack_size - 2];
+            int start = stack_size - 2 - bottom_size;
+            const Instance& instance = instances[id];
+            glm::vec3 o_local = transform_point(instance.inverse, o);
+            glm::vec3 d_local = transform_vector(instance.inverse, d);
+
+            // the bottom-level traversal may overwrite the size and id, they are put back on top of its stack
+            auto [mask, leaf, t1, t2] = instance.bvh->intersect_leaves(o_local, d_local, bottom_size, stack + start);
+            if (leaf < 0) {
+                stack_size = start;
+                continue;
+            }
+            stack[start + bottom_size] = bottom_size;
+            stack[start + bottom_size + 1] = entry;
+            stack_size = start + bottom_size + 2;
+            return {mask, id, leaf, t1, t2};
+        }
+
+        if (entry & SCENE_PENDING) {
+            // a fresh bottom-level stack in place of the pending entry
+            stack[stack_size - 1] = 0;
+            stack[stack_size] = 1;
+            stack[stack_size + 1] = (entry & ~SCENE_PENDING) | SCENE_ENTERED;
+            stack_size += 2;
+            continue;
+        }
+
+        auto [mask, leaf, t1, t2] = top.intersect_leaves(o, d, stack_size, stack);
+        if (leaf < 0) {
+            break;
+        }
+        if (!mask) {
+            continue;
+        }
+
+        // pushed backwards, so that the instances of the leaf are entered in order
+        const FlatNode& node = top.flat_nodes[leaf];
+        for (uint32_t i = node.offset + node.count; i > node.offset; i--) {
+            stack[stack_size++] = top_ids[top.prim_indices[i - 1]] | SCENE_PENDING;
+        }
+    }
+
+    return {false, -1, -1, 0, 0};
+}
+
+
+void Scene::intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits) {
+    int first = hits.size();
+
+    traverse_instances(*this, o, d, -FLT_MAX, FLT_MAX, [&](int id, const glm::vec3& o_local, const glm::vec3& d_local, float t_cur) {
+        int begin = hits.size();
+        instances[id].bvh->intersect_all_leaves(o_local, d_local, max_hits, hits);
+        for (int i = begin; i < hits.size(); i++) {
+            hits[i].instance = id;
+        }
+        return t_cur;
+    });
+
+    auto by_t_enter = [](const LeafHit& a, const LeafHit& b) {
+        return a.t_enter < b.t_enter;
+    };
+    std::sort(hits.begin() + first, hits.end(), by_t_enter);
+    if (max_hits > 0 && (int) hits.size() - first > max_hits) {
+        hits.resize(first + max_hits);
+    }
+}
+
+
+template std::tuple<bool, int, int, float, float, float> Scene::intersect_triangles<false>(const glm::vec3&, const glm::vec3&, float, float);
+template std::tuple<bool, int, int, float, float, float> Scene::intersect_triangles<true>(const glm::vec3&, const glm::vec3&, float, float);
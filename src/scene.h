@@ -0,0 +1,74 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "bvh.h"
+
+
+// Scene::intersect_leaves keeps top-level nodes, instances still to enter and the state of the
+// entered instance on one stack. The entered instance is on top as its bottom-level stack, the size
+// of that stack and the instance id with SCENE_ENTERED set.
+const uint32_t SCENE_PENDING = 0x40000000u; // stack entry of an instance not entered yet
+const uint32_t SCENE_ENTERED = 0x80000000u; // top entry of the instance being traversed
+
+
+// One placement of a bottom-level BVH. transform maps object space to world space as
+// [A | t] with rows of x' = A x + t, inverse maps world rays back into object space.
+struct Instance {
+    std::shared_ptr<BVH> bvh; // null for removed instances
+    float transform[3][4];
+    float inverse[3][4];
+};
+
+
+// Two-level structure: a top-level BVH over instance bounds in world space, every leaf
+// refers to instances that share their bottom-level trees. Rays are moved into object
+// space when they enter an instance; t is the same in both spaces since directions are
+// transformed without normalization. There is no TraversalStats overload at this level, use
+// the bottom-level BVH for those.
+struct Scene {
+    std::vector<Instance> instances; // indexed by instance id
+    std::vector<int> free_ids;       // removed ids, reused by add_instance
+
+    BVH top;                         // built over the instances in top_ids
+    std::vector<int> top_ids;        // instance id of each top-level primitive
+    bool dirty = false;              // instances changed since the last build
+    int required_stack_size = 1;     // stack entries intersect_leaves may need since the last build
+
+    int add_instance(std::shared_ptr<BVH> bvh, const float transform[3][4]);
+    void update_instance(int id, const float transform[3][4]);
+    void remove_instance(int id);
+    int n_instances() const {
+        return instances.size() - free_ids.size();
+    }
+
+    // rebuilds the top level from the current instances and their bottom-level bounds,
+    // queries need it after instances changed and after bottom-level trees were refit or rebuilt
+    void build();
+
+    // nearest hit over all instances with t in [t_min, t_max]
+    std::tuple<bool, int, int, float, float, float> // mask, instance id, face index, t, u, v
+    closest_hit(const glm::vec3& o, const glm::vec3& d, float t_min = 0, float t_max = FLT_MAX);
+
+    // first hit found with t in [t_min, t_max]
+    std::tuple<bool, int, int, float, float, float> // mask, instance id, face index, t, u, v
+    any_hit(const glm::vec3& o, const glm::vec3& d, float t_min = 0, float t_max = FLT_MAX);
+
+    template <bool AnyHit>
+    std::tuple<bool, int, int, float, float, float>
+    intersect_triangles(const glm::vec3& o, const glm::vec3& d, float t_min, float t_max);
+
+    // next bottom-level leaf hit by the ray, resumed from the stack the same way as BVH::intersect_leaves:
+    // stack_size 1 and stack [0] start a traversal, stack_size 0 after the last leaf. Instances come
+    // depth-first in the top level, the leaves of one instance in the order of its BVH. Stacks are only
+    // valid until the next build.
+    std::tuple<bool, int, int, float, float> // mask, instance id, leaf index, t_enter, t_exit
+    intersect_leaves(const glm::vec3& o, const glm::vec3& d, int& stack_size, uint32_t* stack);
+
+    // bottom-level leaves of all instances along the ray with LeafHit::instance set, ordered by t_enter
+    void intersect_all_leaves(const glm::vec3& o, const glm::vec3& d, int max_hits, std::vector<LeafHit>& hits);
+};
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+
+// Fixed-width float vectors for box and triangle tests. Widths without a matching instruction
+// set fall back to plain arrays. min/max follow glm's operand order (min(a, b) = b < a ? b : a),
+// so results are bit-identical to the scalar glm code, NaNs included.
+
+template <int W>
+struct vmask {
+    uint32_t bits; // one bit per lane
+};
+
+template <int W>
+struct vfloat {
+    float v[W];
+
+    static vfloat load(const float *p) {
+        vfloat r;
+        std::memcpy(r.v, p, sizeof(r.v));
+        return r;
+    }
+    static vfloat broadcast(float x) {
+        vfloat r;
+        std::fill(r.v, r.v + W, x);
+        return r;
+    }
+    void store(float *p) const {
+        std::memcpy(p, v, sizeof(v));
+    }
+    float operator[](int i) const {
+        return v[i];
+    }
+};
+
+#define VFLOAT_GENERIC_OP(op)                                             \
+template <int W>                                                          \
+inline vfloat<W> operator op(const vfloat<W>& a, const vfloat<W>& b) {    \
+    vfloat<W> r;                                                          \
+    for (int i = 0; i < W; i++) r.v[i] = a.v[i] op b.v[i];                \
+    return r;                                                             \
+}
+VFLOAT_GENERIC_OP(+)
+VFLOAT_GENERIC_OP(-)
+VFLOAT_GENERIC_OP(*)
+VFLOAT_GENERIC_OP(/)
+#undef VFLOAT_GENERIC_OP
+
+#define VFLOAT_GENERIC_CMP(op)                                            \
+template <int W>                                                          \
+inline vmask<W> operator op(const vfloat<W>& a, const vfloat<W>& b) {     \
+    vmask<W> r = {0};                                                     \
+    for (int i = 0; i < W; i++) r.bits |= (uint32_t) (a.v[i] op b.v[i]) << i; \
+    return r;                                                             \
+}
+VFLOAT_GENERIC_CMP(<)
+VFLOAT_GENERIC_CMP(>)
+VFLOAT_GENERIC_CMP(<=)
+VFLOAT_GENERIC_CMP(>=)
+#undef VFLOAT_GENERIC_CMP
+
+template <int W>
+inline vfloat<W> vmin(const vfloat<W>& a, const vfloat<W>& b) {
+    vfloat<W> r;
+    for (int i = 0; i < W; i++) r.v[i] = b.v[i] < a.v[i] ? b.v[i] : a.v[i];
+    return r;
+}
+
+template <int W>
+inline vfloat<W> vmax(const vfloat<W>& a, const vfloat<W>& b) {
+    vfloat<W> r;
+    for (int i = 0; i < W; i++) r.v[i] = a.v[i] < b.v[i] ? b.v[i] : a.v[i];
+    return r;
+}
+
+template <int W>
+inline vmask<W> operator&(const vmask<W>& a, const vmask<W>& b) {
+    return {a.bits & b.bits};
+}
+
+template <int W>
+inline vmask<W> operator|(const vmask<W>& a, const vmask<W>& b) {
+    return {a.bits | b.bits};
+}
+
+template <int W>
+inline vmask<W> operator~(const vmask<W>& a) {
+    return {~a.bits & (W == 32 ? ~0u : (1u << W) - 1)};
+}
+
+template <int W>
+inline uint32_t movemask(const vmask<W>& a) {
+    return a.bits;
+}
+
+
+#ifdef __SSE2__
+
+template <>
+struct vmask<4> {
+    __m128 m;
+};
+
+template <>
+struct vfloat<4> {
+    __m128 m;
+
+    static vfloat load(const float *p) { return {_mm_loadu_ps(p)}; }
+    static vfloat broadcast(float x) { return {_mm_set1_ps(x)}; }
+    void store(float *p) const { _mm_storeu_ps(p, m); }
+    float operator[](int i) const {
+        alignas(16) float v[4];
+        _mm_store_ps(v, m);
+        return v[i];
+    }
+};
+
+inline vfloat<4> operator+(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_add_ps(a.m, b.m)}; }
+inline vfloat<4> operator-(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_sub_ps(a.m, b.m)}; }
+inline vfloat<4> operator*(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_mul_ps(a.m, b.m)}; }
+inline vfloat<4> operator/(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_div_ps(a.m, b.m)}; }
+inline vmask<4> operator<(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_cmplt_ps(a.m, b.m)}; }
+inline vmask<4> operator>(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_cmpgt_ps(a.m, b.m)}; }
+inline vmask<4> operator<=(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_cmple_ps(a.m, b.m)}; }
+inline vmask<4> operator>=(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_cmpge_ps(a.m, b.m)}; }
+// _mm_min_ps(x, y) is x < y ? x : y
+inline vfloat<4> vmin(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_min_ps(b.m, a.m)}; }
+inline vfloat<4> vmax(const vfloat<4>& a, const vfloat<4>& b) { return {_mm_max_ps(b.m, a.m)}; }
+inline vmask<4> operator&(const vmask<4>& a, const vmask<4>& b) { return {_mm_and_ps(a.m, b.m)}; }
+inline vmask<4> operator|(const vmask<4>& a, const vmask<4>& b) { return {_mm_or_ps(a.m, b.m)}; }
+inline vmask<4> operator~(const vmask<4>& a) { return {_mm_xor_ps(a.m, _mm_castsi128_ps(_mm_set1_epi32(-1)))}; }
+inline uint32_t movemask(const vmask<4>& a) { return _mm_movemask_ps(a.m); }
+
+#endif
+
+
+#ifdef __AVX__
+
+template <>
+struct vmask<8> {
+    __m256 m;
+};
+
+template <>
+struct vfloat<8> {
+    __m256 m;
+
+    static vfloat load(const float *p) { return {_mm256_loadu_ps(p)}; }
+    static vfloat broadcast(float x) { return {_mm256_set1_ps(x)}; }
+    void store(float *p) const { _mm256_storeu_ps(p, m); }
+    float operator[](int i) const {
+        alignas(32) float v[8];
+        _mm256_store_ps(v, m);
+        return v[i];
+    }
+};
+
+inline vfloat<8> operator+(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_add_ps(a.m, b.m)}; }
+inline vfloat<8> operator-(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_sub_ps(a.m, b.m)}; }
+inline vfloat<8> operator*(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_mul_ps(a.m, b.m)}; }
+inline vfloat<8> operator/(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_div_ps(a.m, b.m)}; }
+inline vmask<8> operator<(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_cmp_ps(a.m, b.m, _CMP_LT_OQ)}; }
+inline vmask<8> operator>(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_cmp_ps(a.m, b.m, _CMP_GT_OQ)}; }
+inline vmask<8> operator<=(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_cmp_ps(a.m, b.m, _CMP_LE_OQ)}; }
+inline vmask<8> operator>=(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_cmp_ps(a.m, b.m, _CMP_GE_OQ)}; }
+inline vfloat<8> vmin(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_min_ps(b.m, a.m)}; }
+inline vfloat<8> vmax(const vfloat<8>& a, const vfloat<8>& b) { return {_mm256_max_ps(b.m, a.m)}; }
+inline vmask<8> operator&(const vmask<8>& a, const vmask<8>& b) { return {_mm256_and_ps(a.m, b.m)}; }
+inline vmask<8> operator|(const vmask<8>& a, const vmask<8>& b) { return {_mm256_or_ps(a.m, b.m)}; }
+inline vmask<8> operator~(const vmask<8>& a) { return {_mm256_xor_ps(a.m, _mm256_castsi256_ps(_mm256_set1_epi32(-1)))}; }
+inline uint32_t movemask(const vmask<8>& a) { return _mm256_movemask_ps(a.m); }
+
+#endif
+
+
+#ifdef __AVX512F__
+
+template <>
+struct vmask<16> {
+    __mmask16 m;
+};
+
+template <>
+struct vfloat<16> {
+    __m512 m;
+
+    static vfloat load(const float *p) { return {_mm512_loadu_ps(p)}; }
+    static vfloat broadcast(float x) { return {_mm512_set1_ps(x)}; }
+    void store(float *p) const { _mm512_storeu_ps(p, m); }
+    float operator[](int i) const {
+        alignas(64) float v[16];
+        _mm512_store_ps(v, m);
+        return v[i];
+    }
+};
+
+inline vfloat<16> operator+(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_add_ps(a.m, b.m)}; }
+inline vfloat<16> operator-(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_sub_ps(a.m, b.m)}; }
+inline vfloat<16> operator*(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_mul_ps(a.m, b.m)}; }
+inline vfloat<16> operator/(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_div_ps(a.m, b.m)}; }
+inline vmask<16> operator<(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_LT_OQ)}; }
+inline vmask<16> operator>(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_GT_OQ)}; }
+inline vmask<16> operator<=(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_LE_OQ)}; }
+inline vmask<16> operator>=(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_cmp_ps_mask(a.m, b.m, _CMP_GE_OQ)}; }
+inline vfloat<16> vmin(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_min_ps(b.m, a.m)}; }
+inline vfloat<16> vmax(const vfloat<16>& a, const vfloat<16>& b) { return {_mm512_max_ps(b.m, a.m)}; }
+inline vmask<16> operator&(const vmask<16>& a, const vmask<16>& b) { return {(__mmask16) (a.m & b.m)}; }
+inline vmask<16> operator|(const vmask<16>& a, const vmask<16>& b) { return {(__mmask16) (a.m | b.m)}; }
+inline vmask<16> operator~(const vmask<16>& a) { return {(__mmask16) ~a.m}; }
+inline uint32_t movemask(const vmask<16>& a) { return a.m; }
+
+#endif
+
+
+// widest vector the target supports natively
+#if defined(__AVX512F__)
+const int SIMD_WIDTH = 16;
+#elif defined(__AVX__)
+const int SIMD_WIDTH = 8;
+#else
+const int SIMD_WIDTH = 4;
+#endif
+
+
+// slab test of one ray against W boxes in SoA layout, same arithmetic as ray_box_intersection
+template <int W>
+inline uint32_t ray_box_intersection(
+    const vfloat<W> o[3], const vfloat<W> d[3],
+    const float *min_x, const float *min_y, const float *min_z,
+    const float *max_x, const float *max_y, const float *max_z,
+    vfloat<W>& t_enter, vfloat<W>& t_exit
+) {
+    const float *mins[3] = {min_x, min_y, min_z};
+    const float *maxs[3] = {max_x, max_y, max_z};
+
+    vfloat<W> tmin[3], tmax[3];
+    for (int axis = 0; axis < 3; axis++) {
+        vfloat<W> t1 = (vfloat<W>::load(mins[axis]) - o[axis]) / d[axis];
+        vfloat<W> t2 = (vfloat<W>::load(maxs[axis]) - o[axis]) / d[axis];
+        tmin[axis] = vmin(t1, t2);
+        tmax[axis] = vmax(t1, t2);
+    }
+
+    t_enter = vmax(tmin[0], vmax(tmin[1], tmin[2]));
+    t_exit = vmin(tmax[0], vmin(tmax[1], tmax[2]));
+
+    vfloat<W> zero = vfloat<W>::broadcast(0);
+    return movemask(~((t_exit < zero) | (t_enter > t_exit)));
+}
+
+
+// slab test of W rays in SoA layout against one box, same arithmetic as ray_box_intersection
+template <int W>
+inline uint32_t ray_box_intersection(
+    const vfloat<W> o[3], const vfloat<W> d[3], const float min[3], const float max[3],
+    vfloat<W>& t_enter, vfloat<W>& t_exit
+) {
+    vfloat<W> tmin[3], tmax[3];
+    for (int axis = 0; axis < 3; axis++) {
+        vfloat<W> t1 = (vfloat<W>::broadcast(min[axis]) - o[axis]) / d[axis];
+        vfloat<W> t2 = (vfloat<W>::broadcast(max[axis]) - o[axis]) / d[axis];
+        tmin[axis] = vmin(t1, t2);
+        tmax[axis] = vmax(t1, t2);
+    }
+
+    t_enter = vmax(tmin[0], vmax(tmin[1], tmin[2]));
+    t_exit = vmin(tmax[0], vmin(tmax[1], tmax[2]));
+
+    vfloat<W> zero = vfloat<W>::broadcast(0);
+    return movemask(~((t_exit < zero) | (t_enter > t_exit)));
+}
+
+
+// the same with reciprocal directions, a multiply instead of a division per slab; t_enter and
+// t_exit may differ from ray_box_intersection in the last bit, infinities and NaNs are the same
+template <int W>
+inline uint32_t ray_box_intersection_rcp(
+    const vfloat<W> o[3], const vfloat<W> inv_d[3], const float min[3], const float max[3],
+    vfloat<W>& t_enter, vfloat<W>& t_exit
+) {
+    vfloat<W> tmin[3], tmax[3];
+    for (int axis = 0; axis < 3; axis++) {
+        vfloat<W> t1 = (vfloat<W>::broadcast(min[axis]) - o[axis]) * inv_d[axis];
+        vfloat<W> t2 = (vfloat<W>::broadcast(max[axis]) - o[axis]) * inv_d[axis];
+        tmin[axis] = vmin(t1, t2);
+        tmax[axis] = vmax(t1, t2);
+    }
+
+    t_enter = vmax(tmin[0], vmax(tmin[1], tmin[2]));
+    t_exit = vmin(tmax[0], vmin(tmax[1], tmax[2]));
+
+    vfloat<W> zero = vfloat<W>::broadcast(0);
+    return movemask(~((t_exit < zero) | (t_enter > t_exit)));
+}
+
+
+// Möller–Trumbore per lane, one ray against W triangles given by v0 and the edges e1, e2, or W
+// rays against one broadcast triangle; returns a bit per hit. The formulas are those of the
+// scalar ray_triangle_intersection, but the compiler may contract either into FMAs differently,
+// so t, u and v agree only up to rounding and a ray through a shared edge may hit the other face.
+template <int W>
+inline uint32_t ray_triangle_intersection(
+    const vfloat<W> o[3], const vfloat<W> d[3], const vfloat<W> v0[3], const vfloat<W> e1[3], const vfloat<W> e2[3],
+    vfloat<W>& t, vfloat<W>& u, vfloat<W>& v
+) {
+    auto cross = [](const vfloat<W> a[3], const vfloat<W> b[3], vfloat<W> r[3]) {
+        r[0] = a[1] * b[2] - a[2] * b[1];
+        r[1] = a[2] * b[0] - a[0] * b[2];
+        r[2] = a[0] * b[1] - a[1] * b[0];
+    };
+    auto dot = [](const vfloat<W> a[3], const vfloat<W> b[3]) {
+        return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    };
+
+    vfloat<W> p[3], q[3];
+    cross(d, e2, p);
+    vfloat<W> det = dot(e1, p);
+    vfloat<W> inv_det = vfloat<W>::broadcast(1.0f) / det;
+
+    vfloat<W> s[3] = {o[0] - v0[0], o[1] - v0[1], o[2] - v0[2]};
+    u = dot(s, p) * inv_det;
+    cross(s, e1, q);
+    v = dot(d, q) * inv_det;
+    t = dot(e2, q) * inv_det;
+
+    vfloat<W> zero = vfloat<W>::broadcast(0), one = vfloat<W>::broadcast(1);
+    vmask<W> miss = (u < zero) | (u > one) | (v < zero) | (u + v > one);
+    return movemask(((det < zero) | (det > zero)) & ~miss);
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Work-stealing pool. Every worker owns a deque: it pops its own tasks from the back
+// and steals from the front of the others. Threads that wait on a TaskGroup run tasks
+// themselves, so the caller counts as one of `n_threads` and nested groups can't deadlock.
+class ThreadPool {
+public:
+    explicit ThreadPool(int n_threads = 0) {
+        if (n_threads <= 0) {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        this->n_threads = n_threads;
+
+        // last queue is shared by threads that are not workers of this pool
+        for (int i = 0; i < n_threads; i++) {
+            queues.push_back(std::make_unique<Queue>());
+        }
+        for (int i = 0; i < n_threads - 1; i++) {
+            workers.emplace_back([this, i]() { worker_loop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return n_threads;
+    }
+
+    void submit(std::function<void()> task) {
+        Queue& queue = *queues[current_queue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // runs one pending task on the calling thread, returns false if there was none
+    bool try_run_one() {
+        std::function<void()> task;
+        if (!pop(current_queue(), task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+    // calls f(begin, end) on chunks of at most `grain` items and waits for all of them
+    template <typename F>
+    void parallel_for(int begin, int end, int grain, const F& f);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    int n_threads;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    int queued = 0;
+    bool stopping = false;
+
+    struct WorkerId {
+        const ThreadPool *pool = nullptr;
+        int index = -1;
+    };
+    static WorkerId& worker_id() {
+        static thread_local WorkerId id;
+        return id;
+    }
+
+    int current_queue() const {
+        const WorkerId& id = worker_id();
+        return id.pool == this ? id.index : n_threads - 1;
+    }
+
+    bool pop(int own, std::function<void()>& task) {
+        for (int i = 0; i < n_threads; i++) {
+            int victim = (own + i) % n_threads;
+            Queue& queue = *queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (victim == own) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            std::lock_guard<std::mutex> sleep_lock(sleep_mutex);
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(int index) {
+        worker_id() = {this, index};
+
+        while (true) {
+            std::function<void()> task;
+            if (pop(index, task)) {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]() { return stopping || queued > 0; });
+            if (stopping) {
+                return;
+            }
+        }
+    }
+};
+
+
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+
+    ~TaskGroup() {
+        while (pending > 0) {
+            if (!pool.try_run_one()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    template <typename F>
+    void run(F f) {
+        pending++;
+        pool.submit([this, f]() {
+            try {
+                f();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            pending--;
+        });
+    }
+
+    // helps executing tasks until everything submitted to this group is done, rethrows the first error
+    void wait() {
+        while (pending > 0) {
+            if (!pool.try_run_one()) {
+                std::this_thread::yield();
+            }
+        }
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+private:
+    ThreadPool& pool;
+    std::atomic<int> pending{0};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+};
+
+
+template <typename F>
+void ThreadPool::parallel_for(int begin, int end, int grain, const F& f) {
+    grain = std::max(grain, 1);
+    if (n_threads == 1 || end - begin <= grain) {
+        if (begin < end) {
+            f(begin, end);
+        }
+        return;
+    }
+
+    TaskGroup group(*this);
+    for (int chunk = begin; chunk < end; chunk += grain) {
+        int chunk_end = std::min(end, chunk + grain);
+        group.run([&f, chunk, chunk_end]() { f(chunk, chunk_end); });
+    }
+    group.wait();
+}
+
+
+// Pool shared by every caller that asks for the same number of threads (0 means all cores).
+// It is created on first use and never destroyed, so refits and queries that run every frame
+// don't start threads on each call; the workers sleep until the process exits.
+inline ThreadPool& shared_thread_pool(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    static std::mutex mutex;
+    static std::map<int, ThreadPool *> pools;
+    std::lock_guard<std::mutex> lock(mutex);
+    ThreadPool *&pool = pools[n_threads];
+    if (!pool) {
+        pool = new ThreadPool(n_threads);
+    }
+    return *pool;
+}
@@ -0,0 +1,137 @@
+// Tree quality measures beyond the SAH cost. EPO (end-point overlap, Aila et al. 2013) charges
+// every node for the area of the faces inside its box that belong to other subtrees, since
+// rays ending on those faces still have to traverse the node.
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "bvh.h"
+#include "thread_pool.h"
+
+
+static float polygon_area(const glm::vec3 *poly, int n) {
+    glm::vec3 sum(0);
+    for (int i = 1; i + 1 < n; i++) {
+        sum += glm::cross(poly[i] - poly[0], poly[i + 1] - poly[0]);
+    }
+    return 0.5f * glm::length(sum);
+}
+
+
+TreeStats BVH::tree_stats(bool with_epo) {
+    if (flat_nodes.empty()) {
+        throw std::runtime_error("BVH is not built");
+    }
+
+    int n = flat_nodes.size();
+    TreeStats stats;
+    stats.sah_cost = sah_cost();
+
+    // depth of every node and the range of prim_indices under it, subtrees are contiguous there
+    std::vector<int> depth(n);
+    std::vector<int> range_begin(n), range_end(n);
+    for (int i = 0; i < n; i++) {
+        if (!flat_nodes[i].is_leaf()) {
+            depth[i + 1] = depth[i] + 1;
+            depth[flat_nodes[i].offset] = depth[i] + 1;
+        }
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        const FlatNode& node = flat_nodes[i];
+        if (node.is_leaf()) {
+            range_begin[i] = node.offset;
+            range_end[i] = node.offset + node.count;
+        } else {
+            range_begin[i] = std::min(range_begin[i + 1], range_begin[node.offset]);
+            range_end[i] = std::max(range_end[i + 1], range_end[node.offset]);
+        }
+    }
+
+    float root_area = box_area(flat_nodes[0].min, flat_nodes[0].max);
+    double overlap = 0;
+    for (int i = 0; i < n; i++) {
+        const FlatNode& node = flat_nodes[i];
+        if (node.is_leaf()) {
+            if (node.count >= stats.leaf_sizes.size()) {
+                stats.leaf_sizes.resize(node.count + 1);
+            }
+            if (depth[i] >= stats.leaf_depths.size()) {
+                stats.leaf_depths.resize(depth[i] + 1);
+            }
+            stats.leaf_sizes[node.count]++;
+            stats.leaf_depths[depth[i]]++;
+            continue;
+        }
+
+        const FlatNode& left = flat_nodes[i + 1];
+        const FlatNode& right = flat_nodes[node.offset];
+        glm::vec3 min = glm::max(left.min, right.min);
+        glm::vec3 max = glm::min(left.max, right.max);
+        if (min.x <= max.x && min.y <= max.y && min.z <= max.z) {
+            overlap += box_area(min, max);
+        }
+    }
+    stats.overlap = overlap / root_area;
+    if (!with_epo) {
+        return stats;
+    }
+
+    double total_area = 0;
+    for (const Face& f : mesh.faces) {
+        total_area += 0.5f * glm::length(glm::cross(mesh.vertices[f.v2] - mesh.vertices[f.v1], mesh.vertices[f.v3] - mesh.vertices[f.v1]));
+    }
+
+    ThreadPool& pool = shared_thread_pool(build_params.n_threads);
+    std::vector<double> chunk_epo((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+    pool.parallel_for(0, n, PARALLEL_GRAIN, [&](int begin, int end) {
+        double epo = 0;
+        std::vector<int> stack;
+        for (int i = begin; i < end; i++) {
+            const FlatNode& node = flat_nodes[i];
+            double foreign_area = 0;
+
+            // faces overlapping the box of node i, subtrees entirely under node i are skipped
+            stack.assign(1, 0);
+            while (!stack.empty()) {
+                int j = stack.back();
+                stack.pop_back();
+                const FlatNode& other = flat_nodes[j];
+                if (range_begin[j] >= range_begin[i] && range_end[j] <= range_end[i]) {
+                    continue;
+                }
+                if (!boxes_overlap(node.min, node.max, other.min, other.max)) {
+                    continue;
+                }
+                if (!other.is_leaf()) {
+                    stack.push_back(j + 1);
+                    stack.push_back(other.offset);
+                    continue;
+                }
+
+                for (int k = other.offset; k < other.offset + other.count; k++) {
+                    if (k >= range_begin[i] && k < range_end[i]) {
+                        continue;
+                    }
+                    const Face& f = mesh.faces[prim_indices[k]];
+                    glm::vec3 poly[9];
+                    int n_poly = clip_triangle(mesh.vertices[f.v1], mesh.vertices[f.v2], mesh.vertices[f.v3], node.min, node.max, poly);
+                    foreign_area += polygon_area(poly, n_poly);
+                }
+            }
+
+            epo += foreign_area * (node.is_leaf() ? TRIANGLE_INTERSECTION_COST : TRAVERSAL_COST);
+        }
+        chunk_epo[begin / PARALLEL_GRAIN] = epo;
+    });
+
+    double epo = 0;
+    for (double e : chunk_epo) {
+        epo += e;
+    }
+    stats.epo = total_area > 0 ? epo / total_area : 0;
+
+    return stats;
+}
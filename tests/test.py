@@ -1,8 +1,11 @@
+import os
+import tempfile
+
 import numpy as np
 import matplotlib.pyplot as plt
 from scipy.signal import convolve2d
 
-from bvh import BVH
+from bvh import BVH, BuildMethod, Camera, NodeLayout, RenderMode, Scene
 
 
 def cut_edges(img):    
@@ -13,6 +16,74 @@ def cut_edges(img):
     return mixed
 
 
+def brute_force_hits(vertices, faces, origins, directions):
+    # Moller-Trumbore against every face, t of the nearest hit per ray or inf
+    v0, v1, v2 = (vertices[faces[:, k]].astype(np.float64) for k in range(3))
+    e1, e2 = v1 - v0, v2 - v0
+    with np.errstate(divide='ignore', invalid='ignore'):
+        p = np.cross(directions[:, None, :], e2[None])
+        inv_det = 1 / np.einsum('rfk,fk->rf', p, e1)
+        s = origins[:, None, :] - v0[None]
+        q = np.cross(s, e1[None])
+        u = np.einsum('rfk,rfk->rf', s, p) * inv_det
+        v = np.einsum('rk,rfk->rf', directions, q) * inv_det
+        t = np.einsum('fk,rfk->rf', e2, q) * inv_det
+    hit = (u >= 0) & (v >= 0) & (u + v <= 1) & (t >= 0)
+    return np.where(hit, t, np.inf).min(axis=1)
+
+
+def brute_force_distances(vertices, faces, points):
+    # distance of every point to every face: to the plane inside the triangle, else to the nearest edge
+    v = vertices[faces].astype(np.float64)
+    p = points[:, None, :].astype(np.float64)
+    normal = np.cross(v[:, 1] - v[:, 0], v[:, 2] - v[:, 0])
+    normal /= np.linalg.norm(normal, axis=1, keepdims=True)
+    height = np.einsum('pfk,fk->pf', p - v[None, :, 0], normal)
+    projected = p - height[..., None] * normal
+    inside = np.ones(height.shape, dtype=bool)
+    distance = np.full(height.shape, np.inf)
+    for a, b in [(0, 1), (1, 2), (2, 0)]:
+        edge = v[:, b] - v[:, a]
+        inside &= np.einsum('pfk,fk->pf', np.cross(edge[None], projected - v[None, :, a]), normal) >= 0
+        s = np.clip(np.einsum('pfk,fk->pf', p - v[None, :, a], edge) / np.einsum('fk,fk->f', edge, edge), 0, 1)
+        distance = np.minimum(distance, np.linalg.norm(p - v[None, :, a] - s[..., None] * edge, axis=-1))
+    return np.where(inside, np.abs(height), distance)
+
+
+def brute_force_box_overlaps(vertices, faces, mins, maxs):
+    # separating axis test of every box against every face: box axes, face normal and the nine edge crosses
+    v = vertices[faces].astype(np.float64)[None] - ((mins + maxs) / 2)[:, None, None, :]
+    half = (maxs - mins).astype(np.float64) / 2
+    edges = v[0, :, [1, 2, 0]].transpose(1, 0, 2) - v[0]
+    box_axes = np.broadcast_to(np.eye(3), (len(faces), 3, 3))
+    normals = np.cross(edges[:, 0], edges[:, 1])[:, None]
+    crosses = np.cross(edges[:, :, None], box_axes[:, None]).reshape(-1, 9, 3)
+    axes = np.concatenate([box_axes, normals, crosses], axis=1)
+    projected = np.einsum('qfvk,fak->qfav', v, axes)
+    radius = np.einsum('qk,fak->qfa', half, np.abs(axes))
+    separated = (projected.min(axis=-1) > radius) | (projected.max(axis=-1) < -radius)
+    return ~separated.any(axis=-1)
+
+
+def assert_hits(bvh, origins, directions, reference_t):
+    hit_mask, hit_t, *_ = bvh.closest_hit(origins, directions)
+    assert (hit_mask == np.isfinite(reference_t)).all()
+    assert np.allclose(hit_t[hit_mask], reference_t[hit_mask], rtol=1e-4, atol=1e-5)
+
+
+def leaf_sets(bvh, origins, directions):
+    # leaves of every ray, resumed from a stack until it is empty
+    stack_size = np.ones(len(origins), dtype=np.int32)
+    stack = np.zeros((len(origins), bvh.required_stack_size), dtype=np.uint32)
+    leaves = [set() for _ in origins]
+    while True:
+        mask, leaf_indices, *_ = bvh.intersect_leaves(origins, directions, stack_size, stack)
+        if (leaf_indices < 0).all():
+            return leaves
+        for i in np.flatnonzero(mask):
+            leaves[i].add(leaf_indices[i])
+
+
 # blue, yellow, pink, whatever man, just keep bringing me that
 color_pool = np.array([
     [  0, 128, 128],  # Teal Blue
@@ -28,6 +99,190 @@ color_pool = np.array([
 ])
 
 
+# an empty mesh builds a single empty leaf
+empty = BVH.from_arrays(np.zeros((0, 3), dtype=np.float32), np.zeros((0, 3), dtype=np.uint32))
+empty.build_bvh(15)
+assert empty.depth() == 0 and empty.n_leaves() == 1
+
+
+# a loaded tree refit to new vertices hits the same triangles as a fresh build over them
+grid = np.stack(np.meshgrid(np.arange(16), np.arange(16), indexing='ij'), axis=-1).reshape(-1, 2)
+quads = (16 * np.arange(15)[:, None] + np.arange(15)[None, :]).ravel()
+grid_faces = np.concatenate([np.stack([quads, quads + 16, quads + 1], axis=1),
+                             np.stack([quads + 1, quads + 16, quads + 17], axis=1)]).astype(np.uint32)
+grid_vertices = np.concatenate([grid, np.zeros((len(grid), 1))], axis=1).astype(np.float32)
+moved_vertices = grid_vertices + np.array([0, 0, 1], dtype=np.float32) * (0.2 * grid_vertices[:, :1] + 1)
+
+saved = BVH.from_arrays(grid_vertices, grid_faces)
+saved.build_bvh(15, max_leaf_size=4, leaf_triangles=True)
+with tempfile.TemporaryDirectory() as tmp:
+    saved.save(os.path.join(tmp, "grid.bvh"))
+    loaded = BVH()
+    loaded.load(os.path.join(tmp, "grid.bvh"))
+loaded.refit(moved_vertices)
+fresh = BVH.from_arrays(moved_vertices, grid_faces)
+fresh.build_bvh(15, max_leaf_size=4, leaf_triangles=True)
+
+rng = np.random.default_rng(0)
+origins = np.concatenate([rng.uniform(0.1, 14.9, (1000, 2)), np.full((1000, 1), 10)], axis=1).astype(np.float32)
+directions = np.tile(np.array([0, 0, -1], dtype=np.float32), (1000, 1))
+loaded_mask, loaded_t, *_ = loaded.closest_hit(origins, directions)
+fresh_mask, fresh_t, *_ = fresh.closest_hit(origins, directions)
+assert loaded_mask.all() and (loaded_mask == fresh_mask).all() and np.allclose(loaded_t, fresh_t)
+
+
+# random triangles and long slivers, small enough for brute force references
+rng = np.random.default_rng(1)
+soup_centers = rng.uniform(0, 10, (300, 1, 3))
+sliver_starts = rng.uniform(0, 10, (40, 1, 3))
+sliver_ends = rng.uniform(0, 10, (40, 1, 3))
+slivers = np.concatenate([sliver_starts, sliver_ends, sliver_ends + rng.uniform(-0.05, 0.05, (40, 1, 3))], axis=1)
+soup_vertices = np.concatenate([soup_centers + rng.uniform(-1, 1, (300, 3, 3)), slivers]).reshape(-1, 3).astype(np.float32)
+soup_faces = np.arange(len(soup_vertices), dtype=np.uint32).reshape(-1, 3)
+soup_origins = rng.uniform(-1, 11, (1000, 3)).astype(np.float32)
+soup_directions = (rng.uniform(2, 8, (1000, 3)) - soup_origins).astype(np.float32)
+soup_t = brute_force_hits(soup_vertices, soup_faces, soup_origins, soup_directions)
+
+# the binned SAH builder finds the same hits as the sort-and-sweep one at about its SAH cost
+sweep = BVH.from_arrays(soup_vertices, soup_faces)
+sweep.build_bvh(15, method=BuildMethod.Sweep)
+binned = BVH.from_arrays(soup_vertices, soup_faces)
+binned.build_bvh(15, method=BuildMethod.BinnedSAH)
+assert binned.sah_cost() <= 1.1 * sweep.sah_cost()
+assert_hits(sweep, soup_origins, soup_directions, soup_t)
+assert_hits(binned, soup_origins, soup_directions, soup_t)
+
+# LBVH trees with either code width, refined or not, find the same hits; refinement doesn't raise SAH
+lbvh = BVH.from_arrays(soup_vertices, soup_faces)
+for morton_bits in [30, 63]:
+    unrefined_cost = lbvh.build_bvh(15, method=BuildMethod.LBVH, morton_bits=morton_bits)
+    assert_hits(lbvh, soup_origins, soup_directions, soup_t)
+    assert lbvh.build_bvh(15, method=BuildMethod.LBVH, morton_bits=morton_bits, refine=True) <= unrefined_cost
+    assert_hits(lbvh, soup_origins, soup_directions, soup_t)
+
+# SBVH leaves may share faces; hits stay the same and spatial splits pay off on the slivers
+sbvh = BVH.from_arrays(soup_vertices, soup_faces)
+assert sbvh.build_bvh(15, method=BuildMethod.SBVH) < binned.sah_cost()
+assert_hits(sbvh, soup_origins, soup_directions, soup_t)
+
+# the stackless traversal returns the leaves of the stack-based one in the same order
+for tree in [binned, sbvh]:
+    stack_size = np.ones(len(soup_origins), dtype=np.int32)
+    stack = np.zeros((len(soup_origins), tree.required_stack_size), dtype=np.uint32)
+    tokens = np.zeros(len(soup_origins), dtype=np.uint32)
+    while True:
+        stack_mask, stack_leaves, stack_t1, stack_t2 = tree.intersect_leaves(soup_origins, soup_directions, stack_size, stack)
+        token_mask, token_leaves, token_t1, token_t2 = tree.intersect_leaves_stackless(soup_origins, soup_directions, tokens)
+        assert (stack_leaves == token_leaves).all() and (stack_mask == token_mask).all()
+        assert (stack_t1[stack_mask] == token_t1[stack_mask]).all() and (stack_t2[stack_mask] == token_t2[stack_mask]).all()
+        if (stack_leaves < 0).all():
+            break
+
+# closest points match brute force distances, lie on the face they name and respect max_distance
+points = rng.uniform(-1, 11, (500, 3)).astype(np.float32)
+point_distances = brute_force_distances(soup_vertices, soup_faces, points)
+distance, closest, face_indices, barycentrics = binned.closest_point(points)
+assert np.allclose(distance, point_distances.min(axis=1), atol=1e-4)
+assert np.allclose(point_distances[np.arange(len(points)), face_indices], distance, atol=1e-4)
+assert np.allclose(np.linalg.norm(closest - points, axis=1), distance, atol=1e-4)
+v0, v1, v2 = (soup_vertices[soup_faces[face_indices, k]] for k in range(3))
+assert np.allclose(v0 + barycentrics[:, :1] * (v1 - v0) + barycentrics[:, 1:] * (v2 - v0), closest, atol=1e-4)
+distance, closest, face_indices, barycentrics = binned.closest_point(points, max_distance=0.5)
+assert ((face_indices >= 0) == (point_distances.min(axis=1) <= 0.5)).all()
+
+# range queries find the faces brute force overlap tests find, each once and in input order also when sorted
+query_mins = rng.uniform(-1, 10, (100, 3)).astype(np.float32)
+query_maxs = query_mins + rng.uniform(0, 2, (100, 3)).astype(np.float32)
+query_centers = rng.uniform(-1, 11, (100, 3)).astype(np.float32)
+query_radii = rng.uniform(0, 1.5, 100).astype(np.float32)
+box_overlaps = brute_force_box_overlaps(soup_vertices, soup_faces, query_mins, query_maxs)
+sphere_overlaps = brute_force_distances(soup_vertices, soup_faces, query_centers) <= query_radii[:, None]
+for tree in [binned, sbvh]:
+    for sort_queries in [False, True]:
+        box_results = tree.query_aabb(query_mins, query_maxs, sort_queries=sort_queries)
+        sphere_results = tree.query_sphere(query_centers, query_radii, sort_queries=sort_queries)
+        for (offsets, ids), overlaps in [(box_results, box_overlaps), (sphere_results, sphere_overlaps)]:
+            for i in range(len(overlaps)):
+                found = ids[offsets[i]:offsets[i + 1]]
+                assert len(found) == len(set(found)) and set(found) == set(np.flatnonzero(overlaps[i]))
+
+# sorted batches take NaN queries, which find nothing, and unbounded ones, which find every face
+nan_box, all_space = [np.nan] * 3, [np.inf] * 3
+plain_offsets, plain_ids = binned.query_aabb(query_mins, query_maxs)
+offsets, ids = binned.query_aabb(np.vstack([query_mins, nan_box, np.negative(all_space)]), np.vstack([query_maxs, nan_box, all_space]),
+                                 sort_queries=True)
+assert (offsets[:-2] == plain_offsets).all() and (ids[:offsets[-3]] == plain_ids).all()
+assert offsets[-2] == offsets[-3] and sorted(ids[offsets[-2]:]) == list(range(len(soup_faces)))
+offsets, ids = binned.query_sphere(np.vstack([query_centers, nan_box]), np.append(query_radii, 1), sort_queries=True)
+assert offsets[-1] == offsets[-2]
+
+# a scene finds the nearest of the hits of its instances' trees with the rays moved into object space,
+# and returns the leaves of all instances one by one from a stack, also after instances change
+scene = Scene()
+turned = np.array([[0, -1.5, 0, 25], [1.5, 0, 0, 0], [0, 0, 1.5, 0]], dtype=np.float32)
+instances = {scene.add_instance(binned, np.eye(3, 4, dtype=np.float32)): binned}
+instances[scene.add_instance(sbvh, turned)] = sbvh
+scene.remove_instance(scene.add_instance(lbvh, turned))
+scene_origins = rng.uniform(-1, 26, (300, 3)).astype(np.float32)
+scene_directions = (rng.uniform(0, 16, (300, 3)) - scene_origins).astype(np.float32)
+for moved in [False, True]:
+    if moved:
+        turned[:, 3] = [20, 5, -2]
+        scene.update_instance(1, turned)
+    transforms = {0: np.eye(3, 4), 1: turned}
+
+    instance_t = np.full((len(instances), len(scene_origins)), np.inf)
+    instance_faces = np.zeros((len(instances), len(scene_origins)), dtype=np.int32)
+    for id, tree in instances.items():
+        inverse = np.linalg.inv(transforms[id][:, :3])
+        local_origins = (scene_origins - transforms[id][:, 3]) @ inverse.T
+        hit_mask, hit_t, instance_faces[id], _ = tree.closest_hit(local_origins, scene_directions @ inverse.T)
+        instance_t[id, hit_mask] = hit_t[hit_mask]
+    nearest = instance_t.argmin(axis=0)
+    hit_mask, hit_t, hit_instances, hit_faces, _ = scene.closest_hit(scene_origins, scene_directions)
+    assert hit_mask.any() and (hit_mask == np.isfinite(instance_t.min(axis=0))).all()
+    assert np.allclose(hit_t[hit_mask], instance_t.min(axis=0)[hit_mask], rtol=1e-4)
+    assert (hit_instances[hit_mask] == nearest[hit_mask]).all()
+    assert (hit_faces[hit_mask] == instance_faces[nearest, np.arange(len(scene_origins))][hit_mask]).all()
+
+    offsets, leaf_instances, leaves, *_ = scene.intersect_all_leaves(scene_origins, scene_directions)
+    stack_size = np.ones(len(scene_origins), dtype=np.int32)
+    stack = np.zeros((len(scene_origins), scene.required_stack_size), dtype=np.uint32)
+    resumed = [set() for _ in scene_origins]
+    while True:
+        leaf_mask, resumed_instances, resumed_leaves, *_ = scene.intersect_leaves(scene_origins, scene_directions, stack_size, stack)
+        if (resumed_leaves < 0).all():
+            break
+        for i in np.flatnonzero(leaf_mask):
+            resumed[i].add((resumed_instances[i], resumed_leaves[i]))
+    for i in range(len(scene_origins)):
+        assert resumed[i] == set(zip(leaf_instances[offsets[i]:offsets[i + 1]], leaves[offsets[i]:offsets[i + 1]]))
+
+# optimize lowers the SAH cost of LBVH and SBVH trees, reports the cost the tree has and keeps the hits
+for method in [BuildMethod.LBVH, BuildMethod.SBVH]:
+    optimized = BVH.from_arrays(soup_vertices, soup_faces)
+    built_cost = optimized.build_bvh(15, method=method)
+    sah_before, sah_after, passes = optimized.optimize()
+    assert np.isclose(sah_before, built_cost) and sah_after < sah_before and passes >= 1
+    assert np.isclose(optimized.sah_cost(), sah_after)
+    assert_hits(optimized, soup_origins, soup_directions, soup_t)
+
+# quantized boxes contain the exact ones: the same hits and leaf indices, and maybe a few more leaves
+flat_leaves = leaf_sets(binned, soup_origins, soup_directions)
+for layout in [NodeLayout.Quantized8, NodeLayout.Quantized16]:
+    compact = BVH.from_arrays(soup_vertices, soup_faces)
+    compact.build_bvh(15, layout=layout)
+    assert_hits(compact, soup_origins, soup_directions, soup_t)
+    assert all(flat <= quantized for flat, quantized in zip(flat_leaves, leaf_sets(compact, soup_origins, soup_directions)))
+
+# wide layouts return the leaves of the Flat layout, in another order, and find the same hits
+for layout in [NodeLayout.Wide4, NodeLayout.Wide8]:
+    wide = BVH.from_arrays(soup_vertices, soup_faces)
+    wide.build_bvh(15, layout=layout)
+    assert_hits(wide, soup_origins, soup_directions, soup_t)
+    assert leaf_sets(wide, soup_origins, soup_directions) == flat_leaves
+
+
 loader = BVH()
 loader.load_scene("suzanne2.fbx")
 loader.build_bvh(15)
@@ -50,6 +305,16 @@ stack = np.zeros((origins.shape[0], 20), dtype=np.uint32)
 mask, leaf_indices, t1, t2 = loader.intersect_leaves(origins, directions, stack_size, stack)
 mask_img = mask.reshape(resolution, resolution)
 
+# ==== rendered in the library, camera rays through pixel centers generated in tiles ====
+# camera = Camera(origin=[-1, -5, 0], forward=[1, 5, 0], right=[1.5, 0, 0], up=[0, 0, 1.5])
+# mask_img = np.zeros((resolution, resolution), dtype=bool)
+# leaf_img = np.zeros((resolution, resolution), dtype=np.int32)
+# t1_img = np.zeros((resolution, resolution), dtype=np.float32)
+# loader.render(camera, resolution, resolution, RenderMode.FirstLeaf, mask=mask_img, ids=leaf_img, t_enter=t1_img)
+# faces instead of leaves, t_enter is then the hit distance
+# loader.render(camera, resolution, resolution, RenderMode.ClosestHit, mask=mask_img, ids=leaf_img, t_enter=t1_img)
+# mask, leaf_indices, t1 = mask_img.ravel(), leaf_img.ravel(), t1_img.ravel()
+
 image = np.zeros((resolution, resolution, 3))
 
 print("Number of nodes: ", loader.n_nodes())
@@ -72,6 +337,16 @@ img[~mask_img] = 255
 # img = cut_edges(img)
 # img[~mask_img] = 1
 
+# stackless, one uint32 token per ray instead of a stack, updated in place so that the next call resumes
+# tokens = np.zeros((origins.shape[0],), dtype=np.uint32)
+# mask, leaf_indices, t1, t2 = loader.intersect_leaves_stackless(origins, directions, tokens)
+
+# ==== traversal cost ====
+# *_, stats = loader.closest_hit(origins, directions, return_stats=True)
+# img = stats["nodes_visited"].reshape(resolution, resolution)
+# img = img / np.max(img)
+# print(loader.tree_stats())
+
 plt.axis('off')
 
 plt.imshow(img, cmap='gray')